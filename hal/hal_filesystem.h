@@ -22,4 +22,21 @@ int32_t hal_fseek(FILE* pFile, int startPos);
 size_t hal_fread(FILE* pFile, void* dst, size_t numBytes);
 int32_t hal_ftell(FILE* pFile);
 
+// ---- optional memory mapping ----
+// HALs which can map files into memory (see hal_posix.h) are built with HAL_FMAP defined. midifile.c then reads
+// mapped files straight from memory instead of going through hal_fseek() / hal_fread() and the cache.
+#ifdef HAL_FMAP
+// Maps the whole file read-only. Returns NULL, if the file can't be mapped.
+const uint8_t* hal_fmap(FILE* pFile, uint32_t* pSize);
+void hal_funmap(const uint8_t* pData, uint32_t size);
+#endif
+
+// ---- optional positional reads ----
+// HALs which can read at a position without moving the file position (see hal_posix.h) are built with HAL_FREAD_AT
+// defined. midifile.c then reads with one call instead of hal_fseek() + hal_fread(), and several threads may read
+// the same open file at once.
+#ifdef HAL_FREAD_AT
+size_t hal_fread_at(FILE* pFile, void* dst, size_t numBytes, uint32_t startPos);
+#endif
+
 #endif
\ No newline at end of file
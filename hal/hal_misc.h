@@ -2,6 +2,7 @@
 #define __HAL_MISC_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 // Timing function
 uint32_t hal_clock();
@@ -12,4 +13,18 @@ void hal_printfWarning(char* format, ...);
 void hal_printfSuccess(char* format, ...);
 void hal_printfInfo(char* format, ...);
 
+// Background jobs (only needed with MIDI_READ_AHEAD)
+// Runs pJob(pArg) concurrently to the caller, e.g. on a worker thread or a low priority task.
+// Returns false, if the job can't be queued right now.
+bool hal_runAsync(void (*pJob)(void* pArg), void* pArg);
+
+// Called while waiting for a background job to finish. Gives the CPU to other threads, or runs the queued jobs
+// itself, if nothing else would.
+void hal_yield();
+
+// Parallel jobs (only needed with MIDI_PARALLEL)
+// Runs pJob(pArg, iJob) for every iJob from 0 to numJobs - 1, spread over the available cores, and returns when all
+// of them are done. Running them one after another is fine as well.
+void hal_runParallel(void (*pJob)(void* pArg, int32_t iJob), void* pArg, int32_t numJobs);
+
 #endif // __HAL_MISC_H
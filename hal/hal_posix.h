@@ -0,0 +1,191 @@
+//////////////////////////////////////////////////////////////
+// Hardware abstraction layer for Linux and other POSIX     //
+// systems. Build with HAL_FMAP defined, to let midifile.c  //
+// read the memory mapped file instead of using the cache,  //
+// and with HAL_FREAD_AT defined for reads with pread().    //
+// Link with -pthread for hal_runAsync() and                //
+// hal_runParallel().                                       //
+//////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include "hal_filesystem.h"
+#include "hal_misc.h"
+
+// ---- Filesystem functions ----
+
+// Returns 1, if file was opened successfully or 0 on error.
+int32_t hal_fopen(FILE** pFile, const char* pFileName) {
+  *pFile = fopen(pFileName, "rb");
+  return *pFile != NULL;
+}
+
+int32_t hal_fclose(FILE* pFile) {
+  return fclose(pFile) == 0;
+}
+
+int32_t hal_fseek(FILE* pFile, int startPos) {
+  return fseek(pFile, startPos, SEEK_SET);
+}
+
+size_t hal_fread(FILE* pFile, void* dst, size_t numBytes) {
+  return fread(dst, 1, numBytes, pFile);
+}
+
+int32_t hal_ftell(FILE* pFile) {
+  return ftell(pFile);
+}
+
+size_t hal_fread_at(FILE* pFile, void* dst, size_t numBytes, uint32_t startPos) {
+  // pread() leaves the file position alone, so it can be called from several threads at once.
+  size_t bytesReadTotal = 0;
+
+  while (bytesReadTotal < numBytes) {
+    ssize_t bytesRead = pread(fileno(pFile), (uint8_t*)dst + bytesReadTotal, numBytes - bytesReadTotal,
+      (off_t)startPos + bytesReadTotal);
+
+    if (bytesRead < 0 && errno == EINTR)
+      continue;
+
+    if (bytesRead <= 0) // end of file or error
+      break;
+
+    bytesReadTotal += bytesRead;
+  }
+
+  return bytesReadTotal;
+}
+
+// ---- Memory mapping ----
+
+const uint8_t* hal_fmap(FILE* pFile, uint32_t* pSize) {
+  struct stat st;
+  void* pData;
+
+  if (fstat(fileno(pFile), &st) != 0 || st.st_size <= 0 || st.st_size > UINT32_MAX)
+    return NULL;
+
+  pData = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(pFile), 0);
+  if (pData == MAP_FAILED)
+    return NULL;
+
+  // All of the file will be parsed anyway, so let the kernel read it ahead.
+  madvise(pData, st.st_size, MADV_WILLNEED);
+
+  *pSize = (uint32_t)st.st_size;
+  return pData;
+}
+
+void hal_funmap(const uint8_t* pData, uint32_t size) {
+  munmap((void*)pData, size);
+}
+
+// ---- Background jobs ----
+// All jobs run one after another on a single worker thread, which is started by the first job.
+
+#ifndef HAL_ASYNC_QUEUE_SIZE
+#define HAL_ASYNC_QUEUE_SIZE 64
+#endif
+
+static struct {
+  void (*pJob)(void* pArg);
+  void* pArg;
+} hal_asyncQueue[HAL_ASYNC_QUEUE_SIZE];
+
+static uint32_t hal_asyncHead = 0;
+static uint32_t hal_asyncTail = 0;
+static bool hal_asyncStarted = false;
+static pthread_mutex_t hal_asyncMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hal_asyncCond = PTHREAD_COND_INITIALIZER;
+
+static void* hal_asyncWorker(void* pUnused) {
+  for (;;) {
+    void (*pJob)(void* pArg);
+    void* pArg;
+
+    pthread_mutex_lock(&hal_asyncMutex);
+    while (hal_asyncHead == hal_asyncTail)
+      pthread_cond_wait(&hal_asyncCond, &hal_asyncMutex);
+
+    pJob = hal_asyncQueue[hal_asyncTail % HAL_ASYNC_QUEUE_SIZE].pJob;
+    pArg = hal_asyncQueue[hal_asyncTail % HAL_ASYNC_QUEUE_SIZE].pArg;
+    hal_asyncTail++;
+    pthread_mutex_unlock(&hal_asyncMutex);
+
+    pJob(pArg);
+  }
+
+  return NULL;
+}
+
+bool hal_runAsync(void (*pJob)(void* pArg), void* pArg) {
+  bool bQueued = false;
+
+  pthread_mutex_lock(&hal_asyncMutex);
+  if (!hal_asyncStarted) {
+    pthread_t thread;
+    hal_asyncStarted = pthread_create(&thread, NULL, hal_asyncWorker, NULL) == 0;
+    if (hal_asyncStarted)
+      pthread_detach(thread);
+  }
+
+  if (hal_asyncStarted && hal_asyncHead - hal_asyncTail < HAL_ASYNC_QUEUE_SIZE) {
+    hal_asyncQueue[hal_asyncHead % HAL_ASYNC_QUEUE_SIZE].pJob = pJob;
+    hal_asyncQueue[hal_asyncHead % HAL_ASYNC_QUEUE_SIZE].pArg = pArg;
+    hal_asyncHead++;
+    pthread_cond_signal(&hal_asyncCond);
+    bQueued = true;
+  }
+
+  pthread_mutex_unlock(&hal_asyncMutex);
+  return bQueued;
+}
+
+void hal_yield() {
+  sched_yield();
+}
+
+// ---- Parallel jobs ----
+// One thread per core takes the next job until all are taken. The calling thread is one of them.
+
+#define HAL_PARALLEL_MAX_THREADS 64
+
+typedef struct {
+  void (*pJob)(void* pArg, int32_t iJob);
+  void* pArg;
+  int32_t numJobs;
+  int32_t nextJob;
+} hal_parallelWork_t;
+
+static void* hal_parallelWorker(void* pWork) {
+  hal_parallelWork_t* p = pWork;
+  int32_t iJob;
+
+  while ((iJob = __atomic_fetch_add(&p->nextJob, 1, __ATOMIC_RELAXED)) < p->numJobs)
+    p->pJob(p->pArg, iJob);
+
+  return NULL;
+}
+
+void hal_runParallel(void (*pJob)(void* pArg, int32_t iJob), void* pArg, int32_t numJobs) {
+  hal_parallelWork_t work = { pJob, pArg, numJobs, 0 };
+  pthread_t threads[HAL_PARALLEL_MAX_THREADS];
+  long numCores = sysconf(_SC_NPROCESSORS_ONLN);
+  int32_t numThreads = 0;
+
+  // if a thread can't be started, the ones running take its jobs
+  while (numThreads + 1 < numJobs && numThreads + 1 < numCores && numThreads < HAL_PARALLEL_MAX_THREADS &&
+      pthread_create(&threads[numThreads], NULL, hal_parallelWorker, &work) == 0)
+    numThreads++;
+
+  hal_parallelWorker(&work);
+  while (numThreads > 0)
+    pthread_join(threads[--numThreads], NULL);
+}
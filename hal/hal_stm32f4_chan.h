@@ -4,6 +4,7 @@
 //////////////////////////////////////////////////////////////
 
 #include "ff.h"
+#include "../midifile.h"
 
 // ---- Filesystem functions ----
 
@@ -30,6 +31,90 @@ long hal_ftell(FIL* pFile) {
   return f_tell(pFile);
 }
 
+// ---- MIDI byte source ----
+// Lets midiFileOpenSource() read straight through FatFs. pFile must stay valid until the MIDI file is closed.
+
+static size_t hal_fatFsSourceRead(MIDI_SOURCE* pSource, void* dst, uint32_t startPos, size_t num) {
+  FIL* pFile = pSource->pHandle;
+  UINT bytesRead = 0;
+
+  // Seeking walks the cluster chain, so skip it for sequential reads.
+  if (f_tell(pFile) != startPos && f_lseek(pFile, startPos) != FR_OK)
+    return 0;
+
+  f_read(pFile, dst, num, &bytesRead);
+  return bytesRead;
+}
+
+static uint32_t hal_fatFsSourceSize(MIDI_SOURCE* pSource) {
+  return f_size((FIL*)pSource->pHandle);
+}
+
+static void hal_fatFsSourceClose(MIDI_SOURCE* pSource) {
+  f_close(pSource->pHandle);
+}
+
+static const MIDI_SOURCE_FUNCS hal_fatFsSourceFuncs = {
+  hal_fatFsSourceRead, hal_fatFsSourceSize, NULL, hal_fatFsSourceClose, false // f_read() moves the shared file position
+};
+
+// Returns 1, if file was opened successfully or 0 on error.
+int hal_midiSourceInitFatFs(MIDI_SOURCE* pSource, FIL* pFile, const char* pFileName) {
+  if (f_open(pFile, pFileName, FA_READ) != FR_OK)
+    return 0;
+
+  memset(pSource, 0, sizeof(MIDI_SOURCE));
+  pSource->pFuncs = &hal_fatFsSourceFuncs;
+  pSource->pHandle = pFile;
+  pSource->size = f_size(pFile);
+  return 1;
+}
+
+// ---- Background jobs ----
+// Without an RTOS, queued jobs run whenever the application calls hal_runAsyncJobs() from its main loop, e.g. between
+// two midiPlayerTick() calls, so the reads ahead happen in the idle time of the player.
+
+#ifndef HAL_ASYNC_QUEUE_SIZE
+#define HAL_ASYNC_QUEUE_SIZE 8
+#endif
+
+static struct {
+  void (*pJob)(void* pArg);
+  void* pArg;
+} hal_asyncQueue[HAL_ASYNC_QUEUE_SIZE];
+
+static volatile uint32_t hal_asyncHead = 0;
+static volatile uint32_t hal_asyncTail = 0;
+
+bool hal_runAsync(void (*pJob)(void* pArg), void* pArg) {
+  if (hal_asyncHead - hal_asyncTail >= HAL_ASYNC_QUEUE_SIZE)
+    return false;
+
+  hal_asyncQueue[hal_asyncHead % HAL_ASYNC_QUEUE_SIZE].pJob = pJob;
+  hal_asyncQueue[hal_asyncHead % HAL_ASYNC_QUEUE_SIZE].pArg = pArg;
+  hal_asyncHead++;
+  return true;
+}
+
+void hal_runAsyncJobs() {
+  while (hal_asyncTail != hal_asyncHead) {
+    void (*pJob)(void* pArg) = hal_asyncQueue[hal_asyncTail % HAL_ASYNC_QUEUE_SIZE].pJob;
+    void* pArg = hal_asyncQueue[hal_asyncTail % HAL_ASYNC_QUEUE_SIZE].pArg;
+
+    hal_asyncTail++;
+    pJob(pArg);
+  }
+}
+
+void hal_yield() {
+  hal_runAsyncJobs(); // there is no other thread, which could finish them
+}
+
+void hal_runParallel(void (*pJob)(void* pArg, int32_t iJob), void* pArg, int32_t numJobs) {
+  for (int32_t iJob = 0; iJob < numJobs; ++iJob) // single core
+    pJob(pArg, iJob);
+}
+
 char* strcpy_s(char* pDst, int szDst, const char* pSrc) {
   return strcpy(pDst, pSrc); // not secure, but works for now. :)
 }
@@ -30,6 +30,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
@@ -40,93 +41,495 @@
 // -----------------------------------
 // Global variables and new functions
 // -----------------------------------
-_MIDI_FILE _midiFile; // TODO: let the user define and pass the instance, so it is possible to open multiple MIDI files at once?
+// Pool of the files opened by midiFileOpen(). Everything else, including the cache (single window for midi 0 files,
+// split into track windows or blocks by midiFileSetCacheMode() for midi 1 files), lives in the file itself, so
+// different files can be read from different threads.
+static _MIDI_FILE g_midiFilePool[MAX_MIDI_FILES];
+static bool g_midiFilePoolInUse[MAX_MIDI_FILES];
+
+#if defined(__GNUC__)
+#define POOL_CLAIM(pInUse)   (!__atomic_test_and_set((pInUse), __ATOMIC_ACQUIRE))
+#define POOL_RELEASE(pInUse) __atomic_clear((pInUse), __ATOMIC_RELEASE)
+#else // files are opened from one thread only
+#define POOL_CLAIM(pInUse)   (!*(pInUse) && (*(pInUse) = true))
+#define POOL_RELEASE(pInUse) (*(pInUse) = false)
+#endif
+
+#ifdef MIDI_READ_AHEAD
+#define READ_AHEAD_OVERLAP 32 // the read ahead starts this many bytes before the window end, for messages on the border
+
+// aheadState hands the second buffer over between the threads, so it needs acquire / release semantics.
+#if defined(__GNUC__)
+#define READ_AHEAD_STATE(pWnd)            __atomic_load_n(&(pWnd)->aheadState, __ATOMIC_ACQUIRE)
+#define READ_AHEAD_SET_STATE(pWnd, state) __atomic_store_n(&(pWnd)->aheadState, (state), __ATOMIC_RELEASE)
+#else // volatile is sufficient on single core MCUs and with MSVC
+#define READ_AHEAD_STATE(pWnd)            ((pWnd)->aheadState)
+#define READ_AHEAD_SET_STATE(pWnd, state) ((pWnd)->aheadState = (state))
+#endif
+#endif
+
+static size_t _midiCacheFetch(_MIDI_FILE* pMF, void* dst, uint32_t startPos, size_t num) {
+  uint32_t startTime = hal_clock();
+  size_t bytesRead = pMF->source.pFuncs->read(&pMF->source, dst, startPos, num);
+
+  pMF->cacheStats.fetches++;
+  pMF->cacheStats.bytesFetched += bytesRead;
+  pMF->cacheStats.refillTime += hal_clock() - startTime;
+  return bytesRead;
+}
+
+static void _midiCacheCountRead(_MIDI_FILE* pMF, uint32_t fetchesBefore) {
+  // A read of the cache is a hit, if it didn't have to fetch from the source (see MIDI_CACHE_STATS).
+  if (pMF->cacheStats.fetches == fetchesBefore)
+    pMF->cacheStats.hits++;
+  else
+    pMF->cacheStats.misses++;
+}
+
+// Returns a pointer into the file in memory, or NULL if the file isn't in memory or startPos is behind its end.
+// Chunks reaching over the end of the file are cut, so *pNum may be smaller afterwards.
+static const uint8_t* getChunkFromMapping(const _MIDI_FILE* pMF, int32_t startPos, size_t* pNum) {
+  if (!pMF->pMapped || startPos < 0 || (uint32_t)startPos >= pMF->mappedSize)
+    return NULL;
 
-// cache (Only for midi 0 files!)
-static uint8_t g_cache[PLAYBACK_CACHE_SIZE];
-static int32_t g_cacheStartPos = 0;
-static int32_t g_cacheEndPos = 0;
-static bool cacheInitialized = false;
+  if (*pNum > pMF->mappedSize - startPos)
+    *pNum = pMF->mappedSize - startPos;
 
-// TODO: lay out to external callback handler
-void onCacheMiss(uint32_t reqStartPos, uint32_t reqNumBytes, uint32_t cachePosOnReq, uint32_t cacheSize) {
-  hal_printfWarning("Cache Miss: requested: %d bytes from %d, cache was at %d with a size of %d!",
-    reqNumBytes, reqStartPos, cachePosOnReq, cacheSize);
+  return &pMF->pMapped[startPos];
 }
 
-bool requestedChunkStartIsInCache(int32_t startPos, int32_t reqSize, int32_t cacheStartPos, int32_t cacheSize) {
-  return startPos >= cacheStartPos && startPos < cacheStartPos + cacheSize;
+static void _midiCacheInitWindow(_MIDI_FILE* pMF, MIDI_CACHE_WINDOW* pWnd, uint32_t offset, uint32_t size) {
+  memset(pWnd, 0, sizeof(MIDI_CACHE_WINDOW));
+  pWnd->pData = size ? &pMF->cache[offset] : NULL;
+  pWnd->size = size;
+#ifdef MIDI_READ_AHEAD
+  pWnd->pAhead = size ? &pMF->cacheAhead[offset] : NULL;
+#endif
 }
 
-uint32_t readDataToCache(FILE* pFile, uint8_t* cache, int32_t startPos, int32_t num) {
-  g_cacheStartPos = startPos;
-  cacheInitialized = true;
-  hal_fseek(pFile, startPos);
-  return hal_fread(pFile, cache, num);
+#ifdef MIDI_READ_AHEAD
+static void _midiCacheReadAheadJob(void* pArg) {
+  MIDI_CACHE_WINDOW* pWnd = pArg;
+
+  pWnd->aheadNumBytes = pWnd->pAheadSource->pFuncs->read(pWnd->pAheadSource, pWnd->pAhead, pWnd->aheadStartPos,
+    pWnd->aheadSize);
+  READ_AHEAD_SET_STATE(pWnd, aheadReady);
 }
 
-uint32_t readChunkFromCache(void* dst, uint8_t* cache, uint32_t cacheStartPos, int32_t startPos, int32_t num) {
-  // This functions reads data from cache and returns the number of bytes read.
-  // If the requested chunk is not in cache, 0 will be returned.
-  int32_t startPosInCache = startPos - cacheStartPos;
-  int32_t bytesToRead = num <= PLAYBACK_CACHE_SIZE ? num : PLAYBACK_CACHE_SIZE;
+static void _midiCacheWaitForReadAhead(const _MIDI_FILE* pMF) {
+  // Must be called before the buffers of the windows are given up or the source is closed.
+  while (READ_AHEAD_STATE(&pMF->cacheWindow) == aheadPending)
+    hal_yield();
 
-  if (!cacheInitialized || !requestedChunkStartIsInCache(startPos, num, cacheStartPos, PLAYBACK_CACHE_SIZE))
-    return 0;
+  for (int iTrack = 0; iTrack < MAX_MIDI_TRACKS; ++iTrack)
+    while (READ_AHEAD_STATE(&pMF->Track[iTrack].cache) == aheadPending)
+      hal_yield();
+}
+
+static void _midiCacheWaitForSource(const _MIDI_FILE* pMF) {
+  // Most sources can't be read by two threads at once, so the read ahead has to finish before reading them directly.
+  if (!pMF->source.pFuncs->bConcurrentReads)
+    _midiCacheWaitForReadAhead(pMF);
+}
+
+static void _midiCacheScheduleReadAhead(_MIDI_FILE* pMF, MIDI_CACHE_WINDOW* pWnd, uint32_t pos, uint32_t endPos) {
+  // As soon as half of the window is consumed, the data behind it is read into the second buffer.
+  uint32_t wndEndPos = pWnd->startPos + pWnd->numBytes;
+
+  // A window which isn't full already reached the end of its track or file.
+  if (!pWnd->pAhead || READ_AHEAD_STATE(pWnd) != aheadIdle || pWnd->numBytes < pWnd->size || wndEndPos >= endPos)
+    return;
+
+  if (pos < pWnd->startPos + pWnd->numBytes / 2)
+    return;
+
+  pWnd->aheadStartPos = wndEndPos - READ_AHEAD_OVERLAP;
+  pWnd->aheadSize = pWnd->size;
+  if (endPos - pWnd->aheadStartPos < pWnd->aheadSize)
+    pWnd->aheadSize = endPos - pWnd->aheadStartPos;
+
+  pWnd->pAheadSource = &pMF->source;
+  READ_AHEAD_SET_STATE(pWnd, aheadPending);
+  if (!hal_runAsync(_midiCacheReadAheadJob, pWnd))
+    READ_AHEAD_SET_STATE(pWnd, aheadIdle); // try again on the next read
+}
 
-  memcpy(dst, &cache[startPos - cacheStartPos], bytesToRead); // requested data is in cache
-  return bytesToRead;
+static bool _midiCacheSwapInReadAhead(_MIDI_FILE* pMF, MIDI_CACHE_WINDOW* pWnd, uint32_t startPos) {
+  // Returns false, if the read ahead isn't there yet or doesn't hold startPos.
+  uint8_t* pData;
+
+  if (READ_AHEAD_STATE(pWnd) != aheadReady)
+    return false;
+
+  READ_AHEAD_SET_STATE(pWnd, aheadIdle);
+  pMF->cacheStats.bytesFetched += pWnd->aheadNumBytes; // counted here, the job runs on another thread
+  if (startPos < pWnd->aheadStartPos || startPos >= pWnd->aheadStartPos + pWnd->aheadNumBytes)
+    return false; // the reader jumped somewhere else
+
+  pData = pWnd->pData;
+  pWnd->pData = pWnd->pAhead;
+  pWnd->pAhead = pData;
+  pWnd->startPos = pWnd->aheadStartPos;
+  pWnd->numBytes = pWnd->aheadNumBytes;
+  return true;
+}
+#endif
+
+static bool _midiCacheRefill(_MIDI_FILE* pMF, MIDI_CACHE_WINDOW* pWnd, uint32_t endPos, uint32_t backoff,
+    uint32_t startPos, size_t num) {
+  // Refills start backoff bytes before the requested position and don't go beyond endPos, unless the request itself
+  // does. Returns false, if nothing at startPos could be read.
+  uint32_t fillPos = startPos > backoff ? startPos - backoff : startPos;
+  uint32_t fillSize = pWnd->size;
+
+#ifdef MIDI_READ_AHEAD
+  // A read ahead still on its way is left alone, if the source can be read concurrently. Otherwise it has to finish
+  // first anyway, and may bring the data.
+  if (_midiCacheSwapInReadAhead(pMF, pWnd, startPos))
+    return true;
+
+  _midiCacheWaitForSource(pMF);
+  if (_midiCacheSwapInReadAhead(pMF, pWnd, startPos))
+    return true;
+#endif
+  if (fillPos < endPos && endPos - fillPos < fillSize)
+    fillSize = endPos - fillPos;
+
+  if (fillSize < startPos - fillPos + num)
+    fillSize = startPos - fillPos + num <= pWnd->size ? startPos - fillPos + num : pWnd->size;
+
+  if (pMF->pOnCacheMissCb)
+    pMF->pOnCacheMissCb(startPos, num, pWnd->startPos, pWnd->size);
+
+  pWnd->startPos = fillPos;
+  pWnd->numBytes = _midiCacheFetch(pMF, pWnd->pData, fillPos, fillSize);
+
+  if (pWnd->numBytes <= startPos - fillPos) { // end of file?
+    hal_printfWarning("Warning, tried to read over end of file!\r\n");
+    return false;
+  }
+
+  return true;
 }
 
-int32_t readChunkFromFile(FILE* pFile, void* dst, int32_t startPos, size_t num) {
+static int32_t _midiCacheRead(_MIDI_FILE* pMF, MIDI_CACHE_WINDOW* pWnd, uint32_t endPos, uint32_t backoff,
+    void* dst, int32_t startPos, size_t num) {
+  // Reads through the window, which is refilled from the source on a miss.
   uint32_t bytesReadTotal = 0;
   uint32_t bytesRead = 0;
   uint8_t* dstBytePtr = dst;
+  uint32_t fetches = pMF->cacheStats.fetches;
+
+  // Tracks without a window and chunks which don't fit into the window are read uncached.
+  if (num > pWnd->size) {
+#ifdef MIDI_READ_AHEAD
+    _midiCacheWaitForSource(pMF);
+#endif
+    if (pMF->pOnCacheMissCb)
+      pMF->pOnCacheMissCb(startPos, num, pWnd->startPos, pWnd->size);
+
+    bytesReadTotal = _midiCacheFetch(pMF, dst, startPos, num);
+    _midiCacheCountRead(pMF, fetches);
+    return bytesReadTotal;
+  }
+
+  while (num) {
+    if (pWnd->numBytes && (uint32_t)startPos >= pWnd->startPos && (uint32_t)startPos < pWnd->startPos + pWnd->numBytes) {
+      bytesRead = pWnd->startPos + pWnd->numBytes - startPos;
+      if (bytesRead > num)
+        bytesRead = num;
+
+      memcpy(dstBytePtr, &pWnd->pData[startPos - pWnd->startPos], bytesRead);
+      bytesReadTotal += bytesRead;
+      startPos += bytesRead;
+      dstBytePtr += bytesRead;
+      num -= bytesRead;
+    }
+
+    if (num && !_midiCacheRefill(pMF, pWnd, endPos, backoff, startPos, num))
+      break;
+  }
+
+  _midiCacheCountRead(pMF, fetches);
+
+#ifdef MIDI_READ_AHEAD
+  _midiCacheScheduleReadAhead(pMF, pWnd, startPos, endPos);
+#endif
+
+  return bytesReadTotal;
+}
+
+static const uint8_t* _midiCachePeek(_MIDI_FILE* pMF, MIDI_CACHE_WINDOW* pWnd, uint32_t endPos, uint32_t backoff,
+    uint32_t startPos, size_t num) {
+  // Like _midiCacheRead(), but returns a pointer to num contiguous bytes inside of the window instead of copying
+  // them. Returns NULL, if they don't fit into the window or aren't in the file.
+  const uint8_t* pChunk;
+  uint32_t fetches = pMF->cacheStats.fetches;
+
+  if (num > pWnd->size)
+    return NULL;
+
+  if (startPos < pWnd->startPos || startPos + num > pWnd->startPos + pWnd->numBytes) {
+    bool bRefilled = _midiCacheRefill(pMF, pWnd, endPos, backoff, startPos, num);
+
+    _midiCacheCountRead(pMF, fetches);
+    if (!bRefilled || startPos < pWnd->startPos || startPos + num > pWnd->startPos + pWnd->numBytes)
+      return NULL;
+  }
+  else
+    pMF->cacheStats.hits++;
+
+  pChunk = &pWnd->pData[startPos - pWnd->startPos];
+#ifdef MIDI_READ_AHEAD
+  _midiCacheScheduleReadAhead(pMF, pWnd, startPos + num, endPos);
+#endif
+
+  return pChunk;
+}
+
+static MIDI_CACHE_BLOCK* _midiCacheGetBlock(_MIDI_FILE* pMF, uint32_t startPos) {
+  // Returns the block holding startPos. On a miss, the least recently used block is refilled with it.
+  // Returns NULL, if startPos is behind the end of the file.
+  uint32_t blockStartPos = startPos - startPos % pMF->cacheBlockSize;
+  MIDI_CACHE_BLOCK* pLru = &pMF->cacheBlocks[0];
+
+  for (uint32_t iBlock = 0; iBlock < pMF->numCacheBlocks; ++iBlock) {
+    MIDI_CACHE_BLOCK* pBlock = &pMF->cacheBlocks[iBlock];
+
+    if (pBlock->numBytes && pBlock->startPos == blockStartPos) {
+      pBlock->lastUse = ++pMF->cacheUseCounter;
+      return startPos - blockStartPos < pBlock->numBytes ? pBlock : NULL;
+    }
+
+    if (pBlock->lastUse < pLru->lastUse)
+      pLru = pBlock; // unused blocks have lastUse 0, so they are taken first
+  }
+
+  if (pMF->pOnCacheMissCb)
+    pMF->pOnCacheMissCb(startPos, 1, pLru->startPos, pMF->cacheBlockSize);
+
+  pLru->startPos = blockStartPos;
+  pLru->numBytes = _midiCacheFetch(pMF, pLru->pData, blockStartPos, pMF->cacheBlockSize);
+  pLru->lastUse = ++pMF->cacheUseCounter;
+
+  if (pLru->numBytes <= startPos - blockStartPos) { // end of file?
+    hal_printfWarning("Warning, tried to read over end of file!\r\n");
+    return NULL;
+  }
+
+  return pLru;
+}
+
+static int32_t _midiCacheReadBlocks(_MIDI_FILE* pMF, void* dst, uint32_t startPos, size_t num) {
+  uint32_t bytesReadTotal = 0;
+  uint8_t* dstBytePtr = dst;
+  uint32_t fetches = pMF->cacheStats.fetches;
+
+  // Chunks greater than a block are read uncached, instead of pushing everything else out of the cache.
+  if (num > pMF->cacheBlockSize) {
+    if (pMF->pOnCacheMissCb)
+      pMF->pOnCacheMissCb(startPos, num, 0, pMF->cacheBlockSize);
+
+    bytesReadTotal = _midiCacheFetch(pMF, dst, startPos, num);
+    _midiCacheCountRead(pMF, fetches);
+    return bytesReadTotal;
+  }
 
   while (num) {
-    bytesRead = readChunkFromCache(dstBytePtr, g_cache, g_cacheStartPos, startPos, num);
+    const MIDI_CACHE_BLOCK* pBlock = _midiCacheGetBlock(pMF, startPos);
+    uint32_t bytesRead;
+
+    if (!pBlock)
+      break;
+
+    bytesRead = pBlock->startPos + pBlock->numBytes - startPos;
+    if (bytesRead > num)
+      bytesRead = num;
+
+    memcpy(dstBytePtr, &pBlock->pData[startPos - pBlock->startPos], bytesRead);
     bytesReadTotal += bytesRead;
     startPos += bytesRead;
     dstBytePtr += bytesRead;
     num -= bytesRead;
+  }
+
+  _midiCacheCountRead(pMF, fetches);
+  return bytesReadTotal;
+}
+
+static const uint8_t* _midiCachePeekBlocks(_MIDI_FILE* pMF, uint32_t startPos, size_t num) {
+  // Bytes crossing a block border aren't contiguous in memory, so they can't be peeked.
+  uint32_t fetches = pMF->cacheStats.fetches;
+  const MIDI_CACHE_BLOCK* pBlock = _midiCacheGetBlock(pMF, startPos);
+
+  _midiCacheCountRead(pMF, fetches);
+  if (!pBlock || startPos + num > pBlock->startPos + pBlock->numBytes)
+    return NULL;
 
-    if (num) {
-      // For an unknown reason, sometimes after caching, a few bytes earlier are requested, which will result
-      // into another cache miss. To prevent this unnecessary cache miss, a few bytes earlier, from the
-      // requested starting position will be cached.
-      // TODO: Find out, which access causes this!
-      onCacheMiss(startPos, num, g_cacheStartPos, PLAYBACK_CACHE_SIZE);
-      bytesRead = readDataToCache(pFile, g_cache, startPos > 8 ? startPos - 8 : startPos, PLAYBACK_CACHE_SIZE);
+  return &pBlock->pData[startPos - pBlock->startPos];
+}
 
-      if (bytesRead == 0) // end of file?
-        hal_printfWarning("Warning, tried to read over end of file!\r\n");
+int32_t readChunkFromFile(_MIDI_FILE* pMF, void* dst, int32_t startPos, size_t num) {
+  if (pMF->pMapped) { // file is in memory, no cache needed
+    const uint8_t* pChunk = getChunkFromMapping(pMF, startPos, &num);
+    if (!pChunk) {
+      hal_printfWarning("Warning, tried to read over end of file!\r\n");
+      return 0;
     }
+
+    memcpy(dst, pChunk, num);
+    return num;
   }
 
-  return bytesReadTotal;
+  if (pMF->cacheMode == cacheModeBlocks)
+    return _midiCacheReadBlocks(pMF, dst, startPos, num);
+
+  // For an unknown reason, sometimes after caching, a few bytes earlier are requested, which will result
+  // into another cache miss. To prevent this unnecessary cache miss, a few bytes earlier, from the
+  // requested starting position will be cached.
+  // TODO: Find out, which access causes this!
+  return _midiCacheRead(pMF, &pMF->cacheWindow, UINT32_MAX, 8, dst, startPos, num);
+}
+
+static MIDI_CACHE_WINDOW* _midiCacheTrackWindow(_MIDI_FILE* pMF, MIDI_FILE_TRACK* pTrack) {
+  // In cacheModePerTrack the tracks beyond the budget share the single window (see midiFileSetCacheMode()).
+  return pTrack->cache.size ? &pTrack->cache : &pMF->cacheWindow;
+}
+
+static int32_t readChunkFromTrack(_MIDI_FILE* pMF, MIDI_FILE_TRACK* pTrack, void* dst, int32_t startPos, size_t num) {
+  if (pMF->pMapped || pMF->cacheMode != cacheModePerTrack)
+    return readChunkFromFile(pMF, dst, startPos, num);
+
+  // Only this track reads from the window, so everything behind the end of the track chunk would be wasted.
+  return _midiCacheRead(pMF, _midiCacheTrackWindow(pMF, pTrack), pTrack->pEndNew, 0, dst, startPos, num);
+}
+
+static const uint8_t* peekChunkFromTrack(_MIDI_FILE* pMF, MIDI_FILE_TRACK* pTrack, uint32_t startPos, size_t num) {
+  // Returns a pointer to num contiguous bytes at startPos without copying them, or NULL if they can't be provided
+  // in one piece. The pointer is valid until the next read.
+  if (pMF->pMapped) {
+    size_t numAvailable = num;
+    const uint8_t* pChunk = getChunkFromMapping(pMF, startPos, &numAvailable);
+    return numAvailable == num ? pChunk : NULL;
+  }
+
+  if (pMF->cacheMode == cacheModeBlocks)
+    return _midiCachePeekBlocks(pMF, startPos, num);
+
+  if (pMF->cacheMode != cacheModePerTrack)
+    return _midiCachePeek(pMF, &pMF->cacheWindow, UINT32_MAX, 8, startPos, num);
+
+  return _midiCachePeek(pMF, _midiCacheTrackWindow(pMF, pTrack), pTrack->pEndNew, 0, startPos, num);
+}
+
+static int32_t readByteFromTrack(_MIDI_FILE* pMF, MIDI_FILE_TRACK* pTrack, uint8_t* dst, int32_t startPos) {
+  const uint8_t* pByte = peekChunkFromTrack(pMF, pTrack, startPos, sizeof(uint8_t));
+
+  if (!pByte) // no window for this track
+    return readChunkFromTrack(pMF, pTrack, dst, startPos, sizeof(uint8_t));
+
+  *dst = *pByte;
+  return sizeof(uint8_t);
 }
 
-int32_t readByteFromFile(FILE* pFile, uint8_t* dst, int32_t startPos) {
-  return readChunkFromFile(pFile, dst, startPos, sizeof(uint8_t));
+int32_t readByteFromFile(_MIDI_FILE* pMF, uint8_t* dst, int32_t startPos) {
+  return readChunkFromFile(pMF, dst, startPos, sizeof(uint8_t));
 }
 
-int32_t readWordFromFile(FILE* pFile, uint16_t* dst, int32_t startPos) {
-  return readChunkFromFile(pFile, dst, startPos, sizeof(uint16_t));
+int32_t readWordFromFile(_MIDI_FILE* pMF, uint16_t* dst, int32_t startPos) {
+  return readChunkFromFile(pMF, dst, startPos, sizeof(uint16_t));
 }
 
-int32_t readDwordFromFile(FILE* pFile, uint32_t* dst, int32_t startPos) {
-  return readChunkFromFile(pFile, dst, startPos, sizeof(uint32_t));
+int32_t readDwordFromFile(_MIDI_FILE* pMF, uint32_t* dst, int32_t startPos) {
+  return readChunkFromFile(pMF, dst, startPos, sizeof(uint32_t));
 }
 
 void setPlaybackTempo(_MIDI_FILE* pMidiFile, int32_t bpm) {
   pMidiFile->usPerTick = 60000000.0f / (bpm * pMidiFile->Header.PPQN);
 }
 
+/*
+** Byte sources
+*/
+static size_t _midiSourceFileRead(MIDI_SOURCE* pSource, void* dst, uint32_t startPos, size_t num) {
+#ifdef HAL_FREAD_AT
+  return hal_fread_at(pSource->pHandle, dst, num, startPos);
+#else
+  hal_fseek(pSource->pHandle, startPos);
+  return hal_fread(pSource->pHandle, dst, num);
+#endif
+}
+
+static void _midiSourceFileClose(MIDI_SOURCE* pSource) {
+#ifdef HAL_FMAP
+  if (pSource->pData)
+    hal_funmap(pSource->pData, pSource->size);
+#endif
+  hal_fclose(pSource->pHandle);
+}
+
+static size_t _midiSourceMemoryRead(MIDI_SOURCE* pSource, void* dst, uint32_t startPos, size_t num) {
+  if (startPos >= pSource->size)
+    return 0;
+
+  if (num > pSource->size - startPos)
+    num = pSource->size - startPos;
+
+  memcpy(dst, &pSource->pData[startPos], num);
+  return num;
+}
+
+static uint32_t _midiSourceSize(MIDI_SOURCE* pSource) {
+  return pSource->size;
+}
+
+static const uint8_t* _midiSourceData(MIDI_SOURCE* pSource) {
+  return pSource->pData;
+}
+
+#ifdef HAL_FREAD_AT
+static const MIDI_SOURCE_FUNCS _midiSourceFileFuncs = { _midiSourceFileRead, _midiSourceSize, NULL, _midiSourceFileClose, true };
+#else
+static const MIDI_SOURCE_FUNCS _midiSourceFileFuncs = { _midiSourceFileRead, _midiSourceSize, NULL, _midiSourceFileClose, false };
+#endif
+#ifdef HAL_FMAP
+static const MIDI_SOURCE_FUNCS _midiSourceMappedFuncs = { _midiSourceMemoryRead, _midiSourceSize, _midiSourceData, _midiSourceFileClose, true };
+#endif
+static const MIDI_SOURCE_FUNCS _midiSourceMemoryFuncs = { _midiSourceMemoryRead, _midiSourceSize, _midiSourceData, NULL, true };
+
+bool midiSourceInitFile(MIDI_SOURCE* pSource, const char *pFilename) {
+  // Reads the file through the HAL. If the HAL is able to map it (HAL_FMAP), the mapping is read instead.
+  FILE* pFile = NULL;
+
+  if (!hal_fopen(&pFile, pFilename) || !pFile)
+    return false;
+
+  memset(pSource, 0, sizeof(MIDI_SOURCE));
+  pSource->pFuncs = &_midiSourceFileFuncs;
+  pSource->pHandle = pFile;
+#ifdef HAL_FMAP
+  pSource->pData = hal_fmap(pFile, &pSource->size);
+  if (pSource->pData)
+    pSource->pFuncs = &_midiSourceMappedFuncs;
+#endif
+
+  return true;
+}
+
+void midiSourceInitMemory(MIDI_SOURCE* pSource, const void *pData, uint32_t size) {
+  // pData belongs to the caller and must stay valid until the file is closed.
+  memset(pSource, 0, sizeof(MIDI_SOURCE));
+  pSource->pFuncs = &_midiSourceMemoryFuncs;
+  pSource->pData = pData;
+  pSource->size = size;
+}
 
 /*
 ** Internal Functions
 */
 #define DT_DEF				32			/* assume maximum delta-time + msg is no more than 32 bytes */
+#define CHANNEL_MSG_MAX_SIZE	7		/* 4 bytes delta-time + status + 2 data bytes */
+#define SYS_HEADER_MAX_SIZE	10		/* 4 bytes delta-time + 0xFF + meta type + 4 bytes length */
 #define SWAP_WORD(w)		(uint16_t)(((w)>>8)|((w)<<8))
 #define SWAP_DWORD(d)		(uint32_t)((d)>>24)|(((d)>>8)&0xff00)|(((d)<<8)&0xff0000)|(((d)<<24))
 
@@ -159,112 +562,408 @@ static bool _midiValidateTrack(const _MIDI_FILE *pMFembedded, int32_t iTrack) {
   return true;
 }
 
+#ifdef MIDI_CACHE_WARM_UP
+static void _midiCacheMoveTrackHeads(_MIDI_FILE* pMF, int32_t iFirst, int32_t iEnd, const uint8_t* pSpan,
+    uint32_t spanPos, uint32_t spanSize) {
+  // Moves the head of each of the tracks from the span into its window. The windows may share their memory with the
+  // span, so windows which move their data to the left are filled from the first track on, the others from the last.
+  for (int32_t iPass = 0; iPass < 2; ++iPass) {
+    for (int32_t i = iFirst; i < iEnd; ++i) {
+      MIDI_FILE_TRACK* pTrack = &pMF->Track[iPass == 0 ? i : iEnd - 1 - (i - iFirst)];
+      MIDI_CACHE_WINDOW* pWnd = &pTrack->cache;
+      const uint8_t* pSrc = &pSpan[pTrack->ptrNew - spanPos];
+      uint32_t num = spanPos + spanSize - pTrack->ptrNew;
+
+      if ((iPass == 0) != (pWnd->pData <= pSrc))
+        continue;
+
+      if (num > pWnd->size)
+        num = pWnd->size;
+      if (num > pTrack->pEndNew - pTrack->ptrNew)
+        num = pTrack->pEndNew - pTrack->ptrNew;
+
+      memmove(pWnd->pData, pSrc, num);
+      pWnd->startPos = pTrack->ptrNew;
+      pWnd->numBytes = num;
+    }
+  }
+}
+
+static int32_t _midiCacheWarmUpTracks(_MIDI_FILE* pMF, uint32_t* pPtr) {
+  // Switches to cacheModePerTrack and walks the chunk headers from *pPtr on in as few reads as possible: each read
+  // fills all memory behind the windows of the tracks found so far, and the heads of the tracks in it are moved into
+  // their windows. The first message of every track is then cached. The first span is the single window, which the
+  // file header was read with. Returns the number of tracks found, the caller reads the rest (tracks beyond the
+  // budget of the windows, or a cut file).
+  const uint8_t* pSpan = pMF->cacheWindow.pData;
+  uint32_t spanPos = pMF->cacheWindow.startPos;
+  uint32_t spanSize = pMF->cacheWindow.numBytes;
+  bool bEof = spanSize < pMF->cacheWindow.size;
+  int32_t numTracks = midiReadGetNumTracks(pMF);
+  int32_t iTrack = 0;
+
+  midiFileSetCacheMode(pMF, cacheModePerTrack, 0);
+  while (iTrack < numTracks && pMF->Track[iTrack].cache.size > 0) {
+    int32_t iFirst = iTrack;
+
+    if (*pPtr < spanPos || *pPtr + 8 > spanPos + spanSize) {
+      uint8_t* pFree = pMF->Track[iTrack].cache.pData;
+      uint32_t freeSize = (uint32_t)(&pMF->cache[PLAYBACK_CACHE_SIZE] - pFree);
+
+      pSpan = pFree;
+      spanPos = *pPtr;
+      spanSize = _midiCacheFetch(pMF, pFree, spanPos, freeSize);
+      bEof = spanSize < freeSize;
+      if (spanSize < 8)
+        break;
+    }
+
+    // The first track of a span is always taken, the others wait for the next read, if their head is cut off.
+    while (iTrack < numTracks && pMF->Track[iTrack].cache.size > 0 && *pPtr + 8 <= spanPos + spanSize) {
+      MIDI_FILE_TRACK* pTrack = &pMF->Track[iTrack];
+      const uint8_t* pHeader = &pSpan[*pPtr - spanPos];
+      uint32_t sz = ((uint32_t)pHeader[4] << 24) | (pHeader[5] << 16) | (pHeader[6] << 8) | pHeader[7];
+      uint32_t headSize = sz < pTrack->cache.size ? sz : pTrack->cache.size;
+
+      if (iTrack > iFirst && !bEof && *pPtr + 8 + headSize > spanPos + spanSize)
+        break;
+
+      pTrack->pBaseNew = *pPtr;
+      pTrack->sz = sz;
+      pTrack->ptrNew = *pPtr + 8;
+      pTrack->pEndNew = *pPtr + sz + 8;
+      *pPtr += sz + 8;
+      iTrack++;
+    }
+
+    _midiCacheMoveTrackHeads(pMF, iFirst, iTrack, pSpan, spanPos, spanSize);
+    spanSize = 0; // the windows took over its memory
+  }
+
+  return iTrack;
+}
+#endif
+
+// looks ok!
+static bool _midiFileReadHeader(_MIDI_FILE* pMF) {
+  int32_t iTrack;
+  uint32_t ptrNew;
+  uint32_t dwDataNew;
+  uint16_t wDataNew;
+  char magic[5];
+
+  pMF->bOpenForWriting = false;
+
+  /* Is this a valid MIDI file ? */
+  ptrNew = 0;
+  readChunkFromFile(pMF, magic, ptrNew, 4);
+  magic[4] = '\0';
+
+  if (strcmp(magic, "MThd") != 0)
+    return false;
+
+  readDwordFromFile(pMF, &dwDataNew, 4);
+  pMF->Header.iHeaderSize = SWAP_DWORD(dwDataNew);
+
+  readWordFromFile(pMF, &wDataNew, 8);
+  pMF->Header.iVersion = (uint16_t)SWAP_WORD(wDataNew);
+
+  readWordFromFile(pMF, &wDataNew, 10);
+  pMF->Header.iNumTracks = (uint16_t)SWAP_WORD(wDataNew);
+
+  readWordFromFile(pMF, &wDataNew, 12);
+  pMF->Header.PPQN = (uint16_t)SWAP_WORD(wDataNew);
+
+  ptrNew += pMF->Header.iHeaderSize + 8;
+  /*
+  **	 Get all tracks
+  */
+
+  // Init
+  for (int iTrack = 0; iTrack < MAX_MIDI_TRACKS; ++iTrack) {
+    pMF->Track[iTrack].pos = 0;
+    pMF->Track[iTrack].last_status = 0;
+    _midiCacheInitWindow(pMF, &pMF->Track[iTrack].cache, 0, 0);
+  }
+
+  iTrack = 0;
+#ifdef MIDI_CACHE_WARM_UP
+  if (pMF->Header.iVersion == 1 && midiReadGetNumTracks(pMF) > 1 && !pMF->pMapped)
+    iTrack = _midiCacheWarmUpTracks(pMF, &ptrNew);
+#endif
+
+  for (; iTrack < pMF->Header.iNumTracks && iTrack < MAX_MIDI_TRACKS; ++iTrack) {
+    pMF->Track[iTrack].pBaseNew = ptrNew;
+    readDwordFromFile(pMF, &dwDataNew, ptrNew + 4);
+    pMF->Track[iTrack].sz = SWAP_DWORD(dwDataNew);
+    pMF->Track[iTrack].ptrNew = ptrNew + 8;
+    pMF->Track[iTrack].pEndNew = ptrNew + pMF->Track[iTrack].sz + 8;
+    ptrNew += pMF->Track[iTrack].sz + 8;
+  }
+
+  setPlaybackTempo(pMF, MIDI_BPM_DEFAULT);
+
+  return true;
+}
+
 // looks ok!
 MIDI_FILE  *midiFileOpen(const char *pFilename) {
-  FILE* pFileNew = NULL;
-  uint32_t ptrNew;
-  bool bValidFile = false;
-  cacheInitialized = false; // invalidate cache
+  MIDI_SOURCE source;
 
-  if(!hal_fopen(&pFileNew, pFilename))
+  if (!midiSourceInitFile(&source, pFilename))
     return NULL;
 
-  if (pFileNew) {
-    /* Is this a valid MIDI file ? */
-    ptrNew = 0;
-    char magic[5];
-    readChunkFromFile(pFileNew, magic, ptrNew, 4);
-    magic[4] = '\0';
+  return midiFileOpenSource(&source);
+}
 
-    if (strcmp(magic, "MThd") == 0) {
-      uint32_t dwDataNew;
-      uint16_t wDataNew;
+MIDI_FILE  *midiFileOpenMemory(const void *pData, uint32_t size) {
+  MIDI_SOURCE source;
 
-      readDwordFromFile(pFileNew, &dwDataNew, 4);
-      _midiFile.Header.iHeaderSize = SWAP_DWORD(dwDataNew);
+  if (!pData || size == 0)
+    return NULL;
 
-      readWordFromFile(pFileNew, &wDataNew, 8);
-      _midiFile.Header.iVersion = (uint16_t)SWAP_WORD(wDataNew);
+  midiSourceInitMemory(&source, pData, size);
+  return midiFileOpenSource(&source);
+}
 
-      readWordFromFile(pFileNew, &wDataNew, 10);
-      _midiFile.Header.iNumTracks = (uint16_t)SWAP_WORD(wDataNew);
+MIDI_FILE  *midiFileOpenSource(const MIDI_SOURCE *pSource) {
+  // The file takes over the source and closes it in midiFileClose(), or right away if it is no valid MIDI file.
+  if (!pSource || !pSource->pFuncs || !pSource->pFuncs->read)
+    return NULL;
 
-      readWordFromFile(pFileNew, &wDataNew, 12);
-      _midiFile.Header.PPQN = (uint16_t)SWAP_WORD(wDataNew);
+  for (int iFile = 0; iFile < MAX_MIDI_FILES; ++iFile)
+    if (POOL_CLAIM(&g_midiFilePoolInUse[iFile]))
+      return midiFileOpenSourceInto(&g_midiFilePool[iFile], pSource); // midiFileClose() gives it back
 
-      ptrNew += _midiFile.Header.iHeaderSize + 8;
-      /*
-      **	 Get all tracks
-      */
+  hal_printfWarning("Warning, more than MAX_MIDI_FILES files are open!\r\n");
+  if (pSource->pFuncs->close) {
+    MIDI_SOURCE source = *pSource;
+    source.pFuncs->close(&source);
+  }
 
-      // Init
-      for (int iTrack = 0; iTrack < MAX_MIDI_TRACKS; ++iTrack) {
-        _midiFile.Track[iTrack].pos = 0;
-        _midiFile.Track[iTrack].last_status = 0;
-      }
+  return NULL;
+}
 
-      for (int iTrack = 0; iTrack < _midiFile.Header.iNumTracks && iTrack < MAX_MIDI_TRACKS; ++iTrack) {
-        _midiFile.Track[iTrack].pBaseNew = ptrNew;
+MIDI_FILE  *midiFileOpenSourceInto(MIDI_FILE_CONTEXT *pContext, const MIDI_SOURCE *pSource) {
+  // Like midiFileOpenSource(), but the file lives in pContext, which belongs to the caller and must stay valid until
+  // midiFileClose(). Files in different contexts can be read from different threads.
+  _MIDI_FILE* pMF = pContext;
 
-        readDwordFromFile(pFileNew, &dwDataNew, ptrNew + 4);
-        _midiFile.Track[iTrack].sz = SWAP_DWORD(dwDataNew);
-        _midiFile.Track[iTrack].ptrNew = ptrNew + 8;
-        _midiFile.Track[iTrack].pEndNew = ptrNew + _midiFile.Track[iTrack].sz + 8;
-        ptrNew += _midiFile.Track[iTrack].sz + 8;
-      }
+  if (!pMF || !pSource || !pSource->pFuncs || !pSource->pFuncs->read)
+    return NULL;
 
-      _midiFile.bOpenForWriting = false;
-      bValidFile = true;
-    }
-  }
+  memset(pMF, 0, offsetof(_MIDI_FILE, cacheWindow));
+  _midiCacheInitWindow(pMF, &pMF->cacheWindow, 0, PLAYBACK_CACHE_SIZE);
+  pMF->cacheMode = cacheModeSingle;
+  pMF->source = *pSource;
+  pMF->pMapped = pSource->pFuncs->data ? pSource->pFuncs->data(&pMF->source) : NULL;
+  pMF->mappedSize = pMF->pMapped ? pSource->pFuncs->size(&pMF->source) : 0;
 
-  if (!bValidFile)
+  if (!_midiFileReadHeader(pMF)) {
+    midiFileClose(pMF);
     return NULL;
+  }
+
+  return (MIDI_FILE *)pMF;
+}
+
+bool midiFileSetCacheMode(MIDI_FILE* _pMFembedded, tMIDI_CACHE_MODE mode, uint32_t budget) {
+  // In cacheModePerTrack the budget is split into one window per track. The windows share the memory of the
+  // single window cache, so the budget can't be greater than PLAYBACK_CACHE_SIZE. A budget of 0 uses all of it.
+  // In cacheModeBlocks the budget is split into MAX_CACHE_BLOCKS blocks, see midiFileSetCacheBlocks().
+  int32_t numTracks;
+  uint32_t windowSize, numWindows, sharedSize = 0;
+
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded) || pMFembedded->bOpenForWriting)
+    return false;
+
+  if (budget == 0 || budget > PLAYBACK_CACHE_SIZE)
+    budget = PLAYBACK_CACHE_SIZE;
+
+  if (mode == cacheModeBlocks) // as many blocks as possible, so far apart tracks don't push each other out
+    return midiFileSetCacheBlocks(_pMFembedded, NULL, budget / MAX_CACHE_BLOCKS, MAX_CACHE_BLOCKS);
+
+  numTracks = midiReadGetNumTracks(pMFembedded);
+  windowSize = numTracks ? budget / numTracks : budget;
+  if (windowSize < TRACK_CACHE_MIN_SIZE)
+    windowSize = TRACK_CACHE_MIN_SIZE;
+
+  // If not every track fits into the budget, the last window is shared by the tracks beyond it, so adding a track
+  // doesn't make them read byte by byte from the source.
+  numWindows = budget / windowSize;
+  if (numWindows < (uint32_t)numTracks) {
+    numWindows = numWindows ? numWindows - 1 : 0;
+    sharedSize = budget - numWindows * windowSize < windowSize ? budget - numWindows * windowSize : windowSize;
+  }
+
+#ifdef MIDI_READ_AHEAD
+  _midiCacheWaitForReadAhead(pMFembedded);
+#endif
+  // In cacheModePerTrack the single window is the shared one. Without it readChunkFromFile() reads uncached, as the
+  // memory belongs to the track windows.
+  if (mode == cacheModePerTrack)
+    _midiCacheInitWindow(pMFembedded, &pMFembedded->cacheWindow, numWindows * windowSize, sharedSize);
+  else
+    _midiCacheInitWindow(pMFembedded, &pMFembedded->cacheWindow, 0, PLAYBACK_CACHE_SIZE);
+
+  for (int iTrack = 0; iTrack < MAX_MIDI_TRACKS; ++iTrack)
+    _midiCacheInitWindow(pMFembedded, &pMFembedded->Track[iTrack].cache, iTrack * windowSize,
+      mode == cacheModePerTrack && (uint32_t)iTrack < numWindows ? windowSize : 0);
+
+  pMFembedded->cacheMode = mode;
+  pMFembedded->numCacheBlocks = 0;
+  return true;
+}
+
+bool midiFileSetCacheBlocks(MIDI_FILE* _pMFembedded, uint8_t* pBuffer, uint32_t blockSize, uint32_t numBlocks) {
+  // Switches to cacheModeBlocks with numBlocks blocks of blockSize bytes each, replaced least recently used first.
+  // pBuffer must hold blockSize * numBlocks bytes and stay valid until the file is closed or the cache is set up
+  // again; it may be a static buffer. With NULL the built in PLAYBACK_CACHE_SIZE bytes are used, and numBlocks is
+  // cut down to what fits into them.
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded) || pMFembedded->bOpenForWriting || blockSize == 0)
+    return false;
+
+  if (!pBuffer) {
+    pBuffer = pMFembedded->cache;
+    if (numBlocks > PLAYBACK_CACHE_SIZE / blockSize)
+      numBlocks = PLAYBACK_CACHE_SIZE / blockSize;
+  }
+
+  if (numBlocks == 0 || numBlocks > MAX_CACHE_BLOCKS)
+    return false;
+
+#ifdef MIDI_READ_AHEAD
+  _midiCacheWaitForReadAhead(pMFembedded); // read ahead works on the windows only, which are given up here
+#endif
+  _midiCacheInitWindow(pMFembedded, &pMFembedded->cacheWindow, 0, PLAYBACK_CACHE_SIZE); // the blocks may overwrite its memory
+  for (int iTrack = 0; iTrack < MAX_MIDI_TRACKS; ++iTrack)
+    _midiCacheInitWindow(pMFembedded, &pMFembedded->Track[iTrack].cache, 0, 0);
+
+  memset(pMFembedded->cacheBlocks, 0, sizeof(pMFembedded->cacheBlocks));
+  for (uint32_t iBlock = 0; iBlock < numBlocks; ++iBlock)
+    pMFembedded->cacheBlocks[iBlock].pData = &pBuffer[iBlock * blockSize];
+
+  pMFembedded->numCacheBlocks = numBlocks;
+  pMFembedded->cacheBlockSize = blockSize;
+  pMFembedded->cacheUseCounter = 0;
+  pMFembedded->cacheMode = cacheModeBlocks;
+  return true;
+}
+
+bool midiFileSetCacheMissCallback(MIDI_FILE* _pMFembedded, OnCacheMissCallback_t pOnCacheMissCb) {
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded))
+    return false;
 
-  _midiFile.pFile = pFileNew;
-  setPlaybackTempo(&_midiFile, MIDI_BPM_DEFAULT);
+  pMFembedded->pOnCacheMissCb = pOnCacheMissCb;
+  return true;
+}
+
+bool midiFileSetFilter(MIDI_FILE* _pMFembedded, const MIDI_FILTER* pFilter) {
+  // The filter is copied. NULL lets midiReadGetNextMessage() return every event again.
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded))
+    return false;
+
+  pMFembedded->bFilter = pFilter != NULL;
+  if (pFilter)
+    pMFembedded->filter = *pFilter;
+
+  return true;
+}
+
+bool midiFileGetCacheStats(const MIDI_FILE* _pMFembedded, MIDI_CACHE_STATS* pStats) {
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded) || !pStats)
+    return false;
+
+  *pStats = pMFembedded->cacheStats;
+  return true;
+}
+
+bool midiFileResetCacheStats(MIDI_FILE* _pMFembedded) {
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded))
+    return false;
 
-  return (MIDI_FILE *)&_midiFile;
+  memset(&pMFembedded->cacheStats, 0, sizeof(MIDI_CACHE_STATS));
+  return true;
 }
 
 /*
 ** midiRead* Functions
 */
 
+static uint32_t _midiDecodeVarLen(const uint8_t* pChunk, uint32_t* pValue) {
+  // Decodes a variable-length value from 4 readable bytes at once, without a loop over the bytes. Returns its length
+  // in bytes, or 0 if it is longer than the 4 bytes allowed.
+  uint32_t bytes;
+  uint32_t lastBytes;
+  uint32_t len;
+
+  if (!(pChunk[0] & 0x80)) { // most delta times take one byte
+    *pValue = pChunk[0];
+    return 1;
+  }
+
+  bytes = pChunk[0] | (pChunk[1] << 8) | ((uint32_t)pChunk[2] << 16) | ((uint32_t)pChunk[3] << 24);
+  lastBytes = ~bytes & 0x80808080; // the top bit is clear on the last byte of a value
+  if (!lastBytes)
+    return 0;
+
+  len = (lastBytes & 0x80) ? 1 : (lastBytes & 0x8000) ? 2 : (lastBytes & 0x800000) ? 3 : 4;
+
+  // Put the 7 bit groups of all 4 bytes next to each other, then drop the ones behind the value
+  *pValue = ((bytes & 0x7f) << 21) | ((bytes & 0x7f00) << 6) | ((bytes & 0x7f0000) >> 9) | ((bytes & 0x7f000000) >> 24);
+  *pValue >>= 7 * (4 - len);
+  return len;
+}
+
 // ok!
-static uint32_t _midiReadVarLen(_MIDI_FILE* pMFembedded, uint32_t* ptrNew, uint32_t* numEmbedded) {
-  uint32_t valueEmbedded; // TODO: uint8_t instead of uint32_t ???
-  uint8_t c;
+static bool _midiReadVarLen(_MIDI_FILE* pMFembedded, MIDI_FILE_TRACK* pTrack, uint32_t* ptrNew, uint32_t* numEmbedded) {
+  const uint8_t* pChunk;
+  uint32_t len = 0;
+  uint8_t c = 0x80;
 
   // Variable-length values use the lower 7 bits of a byte for data and the top bit to signal a following data byte.
   // If the top bit is set to 1 (0x80), then another value byte follows.
   // A variable - length value may use a maximum of 4 bytes. This means the maximum value that can be represented is
   // 0x0FFFFFFF (represented as 0xFF, 0xFF, 0xFF, 0x7F).
 
-  // TODO: always preload 4 bytes?
-  valueEmbedded = 0;
-  *ptrNew += readChunkFromFile(pMFembedded->pFile, &valueEmbedded, *ptrNew, 1);
-  if (valueEmbedded & 0x80) {
-    valueEmbedded &= 0x7f; // Remove the first bit to extract payload
-    do {
-      *ptrNew += readChunkFromFile(pMFembedded->pFile, &c, *ptrNew, 1);
-      valueEmbedded = (valueEmbedded << 7) + (c & 0x7f);
-    } while (c & 0x80);
+  if (*ptrNew + 4 <= pTrack->pEndNew && (pChunk = peekChunkFromTrack(pMFembedded, pTrack, *ptrNew, 4)))
+    len = _midiDecodeVarLen(pChunk, numEmbedded);
+  else { // near the end of the track or the cache, one byte at a time
+    *numEmbedded = 0;
+    while (len < 4 && (c & 0x80) && *ptrNew + len < pTrack->pEndNew &&
+        readByteFromTrack(pMFembedded, pTrack, &c, *ptrNew + len)) {
+      *numEmbedded = (*numEmbedded << 7) | (c & 0x7f);
+      len++;
+    }
+
+    if (c & 0x80)
+      len = 0;
+  }
+
+  if (!len) {
+    hal_printfWarning("Warning, invalid variable-length value!\r\n");
+    *ptrNew = pTrack->pEndNew; // nothing behind it can be trusted, so the track ends here
+    return false;
   }
 
-  *numEmbedded = valueEmbedded;
-  return(*ptrNew);
+  *ptrNew += len;
+  return true;
 }
 
 // ok!
-static bool _midiReadTrackCopyData(_MIDI_FILE* pMFembedded, MIDI_MSG* pMsgEmbedded, uint32_t ptrEmbedded, size_t* szEmbedded, bool bCopyPtrData) {
-  if (*szEmbedded > META_EVENT_MAX_DATA_SIZE) {
-    printf("\r\n_midiReadTrackCopyData; Warning: Meta data is greater than maximum size! (%zu of %d)\r\n", *szEmbedded, META_EVENT_MAX_DATA_SIZE);
-    *szEmbedded = META_EVENT_MAX_DATA_SIZE; // truncate meta data, since we don't have enough space
-  }
+static bool _midiReadTrackCopyData(_MIDI_FILE* pMFembedded, MIDI_FILE_TRACK* pTrack, MIDI_MSG* pMsgEmbedded, uint32_t ptrEmbedded, size_t* szEmbedded, bool bCopyPtrData) {
+  // Only the first bytes fit into dataEmbedded. The whole data stays available through MIDI_MSG::payload.
+  if (*szEmbedded > META_EVENT_MAX_DATA_SIZE)
+    *szEmbedded = META_EVENT_MAX_DATA_SIZE;
 
   if (bCopyPtrData) {
-    readChunkFromFile(pMFembedded->pFile, pMsgEmbedded->dataEmbedded, ptrEmbedded, *szEmbedded);
+    readChunkFromTrack(pMFembedded, pTrack, pMsgEmbedded->dataEmbedded, ptrEmbedded, *szEmbedded);
     pMsgEmbedded->data_sz_embedded = *szEmbedded;
   }
 
@@ -277,35 +976,342 @@ int32_t midiReadGetNumTracks(const MIDI_FILE *_pMFembedded) {
   return pMFembedded->Header.iNumTracks <= MAX_MIDI_TRACKS ? pMFembedded->Header.iNumTracks : MAX_MIDI_TRACKS;
 }
 
-// looks ok! (TODO: running status interruption by realtime messages?)
-bool midiReadGetNextMessage(const MIDI_FILE* _pMFembedded, int32_t iTrack, MIDI_MSG* pMsgEmbedded) {
-  MIDI_FILE_TRACK *pTrackNew;
-  uint32_t bptrEmbedded, pMsgDataPtrEmbedded;
-  size_t szEmbedded;
+uint32_t midiReadGetNumEvents(const MIDI_FILE* _pMFembedded, int32_t iTrack) {
+  // Number of events of the track, known once the seek index is built or loaded (see midiFileBuildSeekIndex()).
+  _VAR_CAST;
+  if (!IsTrackValid(iTrack))
+    return 0;
+
+  return pMFembedded->Track[iTrack].numEvents;
+}
 
+uint32_t midiReadGetLastTick(const MIDI_FILE* _pMFembedded) {
+  // Tick of the last event of all tracks, the end of the song. Known once any index or map is built or loaded.
   _VAR_CAST;
-  if (!IsTrackValid(iTrack))			return false;
+  if (!IsFilePtrValid(pMFembedded))
+    return 0;
 
-  pTrackNew = &pMFembedded->Track[iTrack];
-  /* FIXME: Check if there is data on this track first!!!	*/
-  if(pTrackNew->ptrNew >= pTrackNew->pEndNew)
-    return false;
+  return pMFembedded->lastTick;
+}
 
-  // Read Delta Time
-  _midiReadVarLen(pMFembedded, &pTrackNew->ptrNew, &pMsgEmbedded->dt);
-  pTrackNew->pos += pMsgEmbedded->dt;
-  pMsgEmbedded->dwAbsPos = pTrackNew->pos;
+uint64_t midiReadGetDuration(const MIDI_FILE* _pMFembedded) {
+  // Length of the song in microseconds, up to its last event. Known once the tempo map is built (see
+  // midiTempoMapBuild()) or loaded with an index which was saved with one, 0 before.
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded))
+    return 0;
 
-  bool bRunningStatus = false;
-  uint8_t eventType;
-  readByteFromFile(pMFembedded->pFile, &eventType, pTrackNew->ptrNew);
+  return pMFembedded->duration;
+}
 
-  if (eventType & 0x80) {	/* Is this a sys message */
-    pMsgEmbedded->iType = (tMIDI_MSG)(eventType & 0xF0);
-    pMsgDataPtrEmbedded = pTrackNew->ptrNew + 1;
+typedef struct {
+  uint32_t dt;
+  uint8_t status;        // including the channel
+  bool bRunningStatus;
+  const uint8_t* pMsg;   // status byte, or first data byte on running status
+  const uint8_t* pData;  // first data byte
+  uint32_t msgSize;      // bytes of the message without delta time
+  uint32_t numBytes;     // bytes of delta time and message
+} _MIDI_PEEKED_MSG;
+
+static bool _midiPeekChannelMessage(_MIDI_FILE* pMFembedded, MIDI_FILE_TRACK* pTrack, uint8_t lastStatus,
+    _MIDI_PEEKED_MSG* pPeeked) {
+  // Fast path for the common case: Delta time and channel message are decoded straight from one contiguous chunk,
+  // which is checked only once. The read position of the track isn't moved. Meta events, sysex and chunks which can't
+  // be provided in one piece return false and have to be decoded byte by byte.
+  uint32_t num = pTrack->pEndNew - pTrack->ptrNew;
+  const uint8_t* pChunk;
+  const uint8_t* p;
+  uint32_t dt = 0;
+  uint32_t numDataBytes;
+  uint32_t i;
+
+  if (num > CHANNEL_MSG_MAX_SIZE)
+    num = CHANNEL_MSG_MAX_SIZE;
+
+  if (!(pChunk = peekChunkFromTrack(pMFembedded, pTrack, pTrack->ptrNew, num)))
+    return false;
 
-    /* SysEx & Meta events don't carry channel info, but something
-    ** important in their lower bits that we must keep */
+  // Delta Time
+  if (num < 4 || !(i = _midiDecodeVarLen(pChunk, &dt)) || i == num)
+    return false;
+
+  p = &pChunk[i];
+  if (p == pChunk + num)
+    return false;
+
+  pPeeked->bRunningStatus = !(*p & 0x80);
+  pPeeked->status = pPeeked->bRunningStatus ? lastStatus : *p;
+  if ((pPeeked->status & 0xF0) == 0xF0 || !(pPeeked->status & 0x80)) // sys messages or nothing to run on
+    return false;
+
+  numDataBytes = (pPeeked->status & 0xF0) == msgSetProgram || (pPeeked->status & 0xF0) == msgChangePressure ? 1 : 2;
+  pPeeked->pMsg = p;
+  if (!pPeeked->bRunningStatus)
+    p++;
+
+  if (p + numDataBytes > pChunk + num)
+    return false;
+
+  pPeeked->dt = dt;
+  pPeeked->pData = p;
+  pPeeked->msgSize = (p - pPeeked->pMsg) + numDataBytes;
+  pPeeked->numBytes = (p - pChunk) + numDataBytes;
+  return true;
+}
+
+static bool _midiReadChannelMessage(_MIDI_FILE* pMFembedded, MIDI_FILE_TRACK* pTrack, MIDI_MSG* pMsgEmbedded,
+    const _MIDI_PEEKED_MSG* pPeeked) {
+  // pPeeked is the message at the read position if the caller has peeked it already, otherwise NULL
+  _MIDI_PEEKED_MSG peeked;
+  const uint8_t* p;
+  tMIDI_MSG type;
+
+  if (pPeeked)
+    peeked = *pPeeked;
+  else if (!_midiPeekChannelMessage(pMFembedded, pTrack, pMsgEmbedded->iLastMsgType | (pMsgEmbedded->iLastMsgChnl - 1),
+      &peeked))
+    return false;
+
+  p = peeked.pData;
+  type = (tMIDI_MSG)(peeked.status & 0xF0);
+  pTrack->pos += peeked.dt;
+  pMsgEmbedded->dt = peeked.dt;
+  pMsgEmbedded->dwAbsPos = pTrack->pos;
+  pMsgEmbedded->iType = type;
+  pMsgEmbedded->iLastMsgType = type;
+  pMsgEmbedded->iLastMsgChnl = (peeked.status & 0x0f) + 1;
+
+  switch (type) {
+    case	msgNoteOff:
+      pMsgEmbedded->MsgData.NoteOff.iChannel = pMsgEmbedded->iLastMsgChnl;
+      pMsgEmbedded->MsgData.NoteOff.iNote = p[0];
+      break;
+    case	msgNoteOn:
+      pMsgEmbedded->MsgData.NoteOn.iChannel = pMsgEmbedded->iLastMsgChnl;
+      pMsgEmbedded->MsgData.NoteOn.iNote = p[0];
+      pMsgEmbedded->MsgData.NoteOn.iVolume = p[1];
+      break;
+    case	msgNoteKeyPressure:
+      pMsgEmbedded->MsgData.NoteKeyPressure.iChannel = pMsgEmbedded->iLastMsgChnl;
+      pMsgEmbedded->MsgData.NoteKeyPressure.iNote = p[0];
+      pMsgEmbedded->MsgData.NoteKeyPressure.iPressure = p[1];
+      break;
+    case	msgControlChange:
+      pMsgEmbedded->MsgData.NoteParameter.iChannel = pMsgEmbedded->iLastMsgChnl;
+      pMsgEmbedded->MsgData.NoteParameter.iControl = p[0];
+      pMsgEmbedded->MsgData.NoteParameter.iParam = p[1];
+      break;
+    case	msgSetProgram:
+      pMsgEmbedded->MsgData.ChangeProgram.iChannel = pMsgEmbedded->iLastMsgChnl;
+      pMsgEmbedded->MsgData.ChangeProgram.iProgram = p[0];
+      break;
+    case	msgChangePressure:
+      pMsgEmbedded->MsgData.ChangePressure.iChannel = pMsgEmbedded->iLastMsgChnl;
+      pMsgEmbedded->MsgData.ChangePressure.iPressure = p[0];
+      break;
+    case	msgSetPitchWheel:
+      pMsgEmbedded->MsgData.PitchWheel.iChannel = pMsgEmbedded->iLastMsgChnl;
+      pMsgEmbedded->MsgData.PitchWheel.iPitch = (p[0] | (p[1] << 7)) - MIDI_WHEEL_CENTRE;
+      break;
+    default:
+      break;
+  }
+
+  // Same as the common copy routine of midiReadGetNextMessage()
+  pMsgEmbedded->iMsgSize = peeked.msgSize;
+  pMsgEmbedded->bImpliedMsg = peeked.bRunningStatus;
+  if (peeked.bRunningStatus)
+    pMsgEmbedded->iImpliedMsg = type;
+
+  memcpy(pMsgEmbedded->dataEmbedded, peeked.pMsg, pMsgEmbedded->iMsgSize);
+  pMsgEmbedded->data_sz_embedded = pMsgEmbedded->iMsgSize;
+  pTrack->ptrNew += peeked.numBytes;
+
+  return true;
+}
+
+static bool _midiFilterWantsMsg(const MIDI_FILTER* pFilter, uint8_t status) {
+  return pFilter->msgMask & MIDI_FILTER_MSG(status);
+}
+
+static bool _midiFilterWantsMeta(const MIDI_FILTER* pFilter, uint8_t metaType) {
+  return pFilter->metaMask[(metaType >> 3) & 0x0f] & (1 << (metaType & 0x07));
+}
+
+static uint32_t _midiPeekSysHeader(_MIDI_FILE* pMFembedded, MIDI_FILE_TRACK* pTrack, uint32_t* pDt, uint8_t* pStatus,
+    uint8_t* pMetaType, uint32_t* pLen) {
+  // Decodes delta time, status, meta type and length of a meta event or sysex from one contiguous chunk, without
+  // moving the read position. Returns the number of bytes up to the data, or 0 if it has to be read byte by byte.
+  const uint8_t* pChunk;
+  uint32_t i, num;
+
+  if (pTrack->pEndNew - pTrack->ptrNew < SYS_HEADER_MAX_SIZE)
+    return 0;
+
+  if (!(pChunk = peekChunkFromTrack(pMFembedded, pTrack, pTrack->ptrNew, SYS_HEADER_MAX_SIZE)))
+    return 0;
+
+  if (!(i = _midiDecodeVarLen(pChunk, pDt)))
+    return 0;
+
+  *pStatus = pChunk[i++];
+  if (*pStatus == msgMetaEvent)
+    *pMetaType = pChunk[i++];
+  else if (*pStatus != msgSysEx1 && *pStatus != msgSysEx2)
+    return 0;
+
+  if (!(num = _midiDecodeVarLen(&pChunk[i], pLen)))
+    return 0;
+
+  return i + num;
+}
+
+static bool _midiSkipUnwantedMessages(_MIDI_FILE* pMFembedded, MIDI_FILE_TRACK* pTrack, MIDI_MSG* pMsgEmbedded,
+    const MIDI_FILTER* pFilter, uint32_t* pDtSkipped, _MIDI_PEEKED_MSG* pPeeked) {
+  // Moves the track to its next event which pFilter wants, or which can't be sized without decoding it. Skipped events
+  // are only sized, their delta times go into the track position and *pDtSkipped, and the running status is kept like
+  // midiReadGetNextMessage() would. If the event stopped at is a channel message which has been peeked already,
+  // pPeeked gets it, otherwise pPeeked->numBytes is 0. Returns false, if the track ends first.
+  uint32_t ptr, dt, len, num;
+  uint8_t status, metaType = 0;
+
+  pPeeked->numBytes = 0;
+  while (pTrack->ptrNew < pTrack->pEndNew) {
+    if (_midiPeekChannelMessage(pMFembedded, pTrack, pMsgEmbedded->iLastMsgType | (pMsgEmbedded->iLastMsgChnl - 1),
+        pPeeked)) {
+      if (_midiFilterWantsMsg(pFilter, pPeeked->status))
+        return true;
+
+      dt = pPeeked->dt;
+      ptr = pTrack->ptrNew + pPeeked->numBytes;
+      pMsgEmbedded->iLastMsgType = (tMIDI_MSG)(pPeeked->status & 0xF0);
+      pMsgEmbedded->iLastMsgChnl = (pPeeked->status & 0x0f) + 1;
+      pPeeked->numBytes = 0;
+    }
+    else if ((num = _midiPeekSysHeader(pMFembedded, pTrack, &dt, &status, &metaType, &len))) {
+      if (status == msgMetaEvent ? _midiFilterWantsMeta(pFilter, metaType) : _midiFilterWantsMsg(pFilter, status))
+        return true;
+
+      ptr = pTrack->ptrNew + num + len;
+      pMsgEmbedded->iLastMsgType = (tMIDI_MSG)status;
+      pMsgEmbedded->iLastMsgChnl = (status & 0x0f) + 1;
+    }
+    else { // across a window border, or near the end of the track
+      ptr = pTrack->ptrNew;
+      if (!_midiReadVarLen(pMFembedded, pTrack, &ptr, &dt)) {
+        pTrack->ptrNew = ptr;
+        return false;
+      }
+
+      if (ptr >= pTrack->pEndNew)
+        return true; // the decoder deals with it
+
+      readByteFromTrack(pMFembedded, pTrack, &status, ptr);
+      if (status == msgMetaEvent || status == msgSysEx1 || status == msgSysEx2) {
+        if (status == msgMetaEvent) {
+          readByteFromTrack(pMFembedded, pTrack, &metaType, ptr + 1);
+          if (_midiFilterWantsMeta(pFilter, metaType))
+            return true;
+
+          ptr += 2;
+        }
+        else {
+          if (_midiFilterWantsMsg(pFilter, status))
+            return true;
+
+          ptr += 1;
+        }
+
+        if (!_midiReadVarLen(pMFembedded, pTrack, &ptr, &len)) {
+          pTrack->ptrNew = ptr;
+          return false;
+        }
+
+        ptr += len;
+        pMsgEmbedded->iLastMsgType = (tMIDI_MSG)status;
+        pMsgEmbedded->iLastMsgChnl = (status & 0x0f) + 1;
+      }
+      else { // channel message
+        bool bRunningStatus = !(status & 0x80);
+        if (bRunningStatus)
+          status = pMsgEmbedded->iLastMsgType | (pMsgEmbedded->iLastMsgChnl - 1);
+
+        // stray sys messages and running status without a status are left to the decoder
+        if ((status & 0xF0) == 0xF0 || !(status & 0x80) || _midiFilterWantsMsg(pFilter, status))
+          return true;
+
+        ptr += (bRunningStatus ? 0 : 1) +
+          ((status & 0xF0) == msgSetProgram || (status & 0xF0) == msgChangePressure ? 1 : 2);
+        pMsgEmbedded->iLastMsgType = (tMIDI_MSG)(status & 0xF0);
+        pMsgEmbedded->iLastMsgChnl = (status & 0x0f) + 1;
+      }
+    }
+
+    pTrack->pos += dt;
+    *pDtSkipped += dt;
+    pTrack->ptrNew = ptr;
+  }
+
+  return false;
+}
+
+bool midiReadGetNextMessage(const MIDI_FILE* _pMFembedded, int32_t iTrack, MIDI_MSG* pMsgEmbedded) {
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded))
+    return false;
+
+  return midiReadGetNextFilteredMessage(pMFembedded, iTrack, pMsgEmbedded,
+    pMFembedded->bFilter ? &pMFembedded->filter : NULL);
+}
+
+// looks ok! (TODO: running status interruption by realtime messages?)
+bool midiReadGetNextFilteredMessage(const MIDI_FILE* _pMFembedded, int32_t iTrack, MIDI_MSG* pMsgEmbedded,
+    const MIDI_FILTER* pFilter) {
+  // Like midiReadGetNextMessage(), but with pFilter instead of the filter of the file. NULL returns every event.
+  MIDI_FILE_TRACK *pTrackNew;
+  uint32_t bptrEmbedded, pMsgDataPtrEmbedded;
+  _MIDI_PEEKED_MSG peeked;
+  uint32_t dtSkipped = 0;
+  size_t szEmbedded;
+
+  _VAR_CAST;
+  if (!IsTrackValid(iTrack))			return false;
+
+  pTrackNew = &pMFembedded->Track[iTrack];
+  /* FIXME: Check if there is data on this track first!!!	*/
+  if(pTrackNew->ptrNew >= pTrackNew->pEndNew)
+    return false;
+
+  pMsgEmbedded->payload.size = 0;
+  pMsgEmbedded->payload.iTrack = iTrack;
+  peeked.numBytes = 0;
+  if (pFilter && !_midiSkipUnwantedMessages(pMFembedded, pTrackNew, pMsgEmbedded, pFilter, &dtSkipped, &peeked))
+    return false;
+
+  if (_midiReadChannelMessage(pMFembedded, pTrackNew, pMsgEmbedded, peeked.numBytes ? &peeked : NULL)) {
+    pMsgEmbedded->dt += dtSkipped;
+    return true;
+  }
+
+  // Read Delta Time
+  if (!_midiReadVarLen(pMFembedded, pTrackNew, &pTrackNew->ptrNew, (uint32_t*)&pMsgEmbedded->dt))
+    return false;
+
+  pTrackNew->pos += pMsgEmbedded->dt;
+  pMsgEmbedded->dwAbsPos = pTrackNew->pos;
+  pMsgEmbedded->dt += dtSkipped;
+
+  bool bRunningStatus = false;
+  uint8_t eventType;
+  readByteFromTrack(pMFembedded, pTrackNew, &eventType, pTrackNew->ptrNew);
+
+  if (eventType & 0x80) {	/* Is this a sys message */
+    pMsgEmbedded->iType = (tMIDI_MSG)(eventType & 0xF0);
+    pMsgDataPtrEmbedded = pTrackNew->ptrNew + 1;
+
+    /* SysEx & Meta events don't carry channel info, but something
+    ** important in their lower bits that we must keep */
     if (pMsgEmbedded->iType == 0xF0)
       pMsgEmbedded->iType = (tMIDI_MSG)(eventType);
   }
@@ -326,7 +1332,7 @@ bool midiReadGetNextMessage(const MIDI_FILE* _pMFembedded, int32_t iTrack, MIDI_
     case	msgNoteOff: { // 0x08 'Note Off'
       uint8_t tmpNote = 0;
       pMsgEmbedded->MsgData.NoteOff.iChannel = pMsgEmbedded->iLastMsgChnl;
-      readByteFromFile(pMFembedded->pFile, &tmpNote, pMsgDataPtrEmbedded);
+      readByteFromTrack(pMFembedded, pTrackNew, &tmpNote, pMsgDataPtrEmbedded);
       pMsgEmbedded->MsgData.NoteOff.iNote = tmpNote;
       pMsgEmbedded->iMsgSize = 3;
       break;
@@ -336,8 +1342,8 @@ bool midiReadGetNextMessage(const MIDI_FILE* _pMFembedded, int32_t iTrack, MIDI_
       uint8_t tmpNote = 0;
       uint8_t tmpVolume = 0;
       pMsgEmbedded->MsgData.NoteOn.iChannel = pMsgEmbedded->iLastMsgChnl;
-      readByteFromFile(pMFembedded->pFile, &tmpNote, pMsgDataPtrEmbedded);
-      readByteFromFile(pMFembedded->pFile, &tmpVolume, pMsgDataPtrEmbedded + 1);
+      readByteFromTrack(pMFembedded, pTrackNew, &tmpNote, pMsgDataPtrEmbedded);
+      readByteFromTrack(pMFembedded, pTrackNew, &tmpVolume, pMsgDataPtrEmbedded + 1);
       pMsgEmbedded->MsgData.NoteOn.iNote = tmpNote;
       pMsgEmbedded->MsgData.NoteOn.iVolume = tmpVolume;
       pMsgEmbedded->iMsgSize = 3;
@@ -348,8 +1354,8 @@ bool midiReadGetNextMessage(const MIDI_FILE* _pMFembedded, int32_t iTrack, MIDI_
       uint8_t tmpNote = 0;
       uint8_t tmpPressure = 0;
       pMsgEmbedded->MsgData.NoteKeyPressure.iChannel = pMsgEmbedded->iLastMsgChnl;
-      readByteFromFile(pMFembedded->pFile, &tmpNote, pMsgDataPtrEmbedded);
-      readByteFromFile(pMFembedded->pFile, &tmpPressure, pMsgDataPtrEmbedded + 1);
+      readByteFromTrack(pMFembedded, pTrackNew, &tmpNote, pMsgDataPtrEmbedded);
+      readByteFromTrack(pMFembedded, pTrackNew, &tmpPressure, pMsgDataPtrEmbedded + 1);
       pMsgEmbedded->MsgData.NoteKeyPressure.iNote = tmpNote;
       pMsgEmbedded->MsgData.NoteKeyPressure.iPressure = tmpPressure;
       pMsgEmbedded->iMsgSize = 3;
@@ -360,8 +1366,8 @@ bool midiReadGetNextMessage(const MIDI_FILE* _pMFembedded, int32_t iTrack, MIDI_
       uint8_t tmpControl = 0;
       uint8_t tmpParam = 0;
       pMsgEmbedded->MsgData.NoteParameter.iChannel = pMsgEmbedded->iLastMsgChnl;
-      readByteFromFile(pMFembedded->pFile, &tmpControl, pMsgDataPtrEmbedded);
-      readByteFromFile(pMFembedded->pFile, &tmpParam, pMsgDataPtrEmbedded + 1);
+      readByteFromTrack(pMFembedded, pTrackNew, &tmpControl, pMsgDataPtrEmbedded);
+      readByteFromTrack(pMFembedded, pTrackNew, &tmpParam, pMsgDataPtrEmbedded + 1);
       pMsgEmbedded->MsgData.NoteParameter.iControl = tmpControl;
       pMsgEmbedded->MsgData.NoteParameter.iParam = tmpParam;
       pMsgEmbedded->iMsgSize = 3;
@@ -371,7 +1377,7 @@ bool midiReadGetNextMessage(const MIDI_FILE* _pMFembedded, int32_t iTrack, MIDI_
     case	msgSetProgram: { // 0x0C 'Program Change'
       uint8_t tmpProgram = 0;
       pMsgEmbedded->MsgData.ChangeProgram.iChannel = pMsgEmbedded->iLastMsgChnl;
-      readByteFromFile(pMFembedded->pFile, &tmpProgram, pMsgDataPtrEmbedded);
+      readByteFromTrack(pMFembedded, pTrackNew, &tmpProgram, pMsgDataPtrEmbedded);
       pMsgEmbedded->MsgData.ChangeProgram.iProgram = tmpProgram;
       pMsgEmbedded->iMsgSize = 2;
       break;
@@ -380,7 +1386,8 @@ bool midiReadGetNextMessage(const MIDI_FILE* _pMFembedded, int32_t iTrack, MIDI_
     case	msgChangePressure: { // 0x0D 'Channel Aftertouch'
       uint8_t tmpPressure = 0;
       pMsgEmbedded->MsgData.ChangePressure.iChannel = pMsgEmbedded->iLastMsgChnl;
-      readByteFromFile(pMFembedded->pFile, &tmpPressure, pMsgDataPtrEmbedded);
+      readByteFromTrack(pMFembedded, pTrackNew, &tmpPressure, pMsgDataPtrEmbedded);
+      pMsgEmbedded->MsgData.ChangePressure.iPressure = tmpPressure;
       pMsgEmbedded->iMsgSize = 2;
       break;
     }
@@ -389,8 +1396,8 @@ bool midiReadGetNextMessage(const MIDI_FILE* _pMFembedded, int32_t iTrack, MIDI_
       pMsgEmbedded->MsgData.PitchWheel.iChannel = pMsgEmbedded->iLastMsgChnl;
       uint8_t tmpPitchLow = 0;
       uint8_t tmpPitchHigh = 0;
-      readByteFromFile(pMFembedded->pFile, &tmpPitchLow, pMsgDataPtrEmbedded);
-      readByteFromFile(pMFembedded->pFile, &tmpPitchHigh, pMsgDataPtrEmbedded + 1);
+      readByteFromTrack(pMFembedded, pTrackNew, &tmpPitchLow, pMsgDataPtrEmbedded);
+      readByteFromTrack(pMFembedded, pTrackNew, &tmpPitchHigh, pMsgDataPtrEmbedded + 1);
       pMsgEmbedded->MsgData.PitchWheel.iPitch = tmpPitchLow | (tmpPitchHigh << 7);
       pMsgEmbedded->MsgData.PitchWheel.iPitch -= MIDI_WHEEL_CENTRE;
       pMsgEmbedded->iMsgSize = 3;
@@ -407,25 +1414,29 @@ bool midiReadGetNextMessage(const MIDI_FILE* _pMFembedded, int32_t iTrack, MIDI_
       // Get Meta Event Type
       bptrEmbedded = pTrackNew->ptrNew;
       uint8_t tmpType = 0;
-      readByteFromFile(pMFembedded->pFile, &tmpType, pTrackNew->ptrNew + 1);
+      readByteFromTrack(pMFembedded, pTrackNew, &tmpType, pTrackNew->ptrNew + 1);
       pMsgEmbedded->MsgData.MetaEvent.iType = tmpType;
 
-      // Get Meta Event Length (TODO: find a 'live' method instead of using a constant sized buffer?)
+      // Get Meta Event Length
       pTrackNew->ptrNew += 2;
-      _midiReadVarLen(pMFembedded, &pTrackNew->ptrNew, &pMsgEmbedded->iMsgSize);
+      if (!_midiReadVarLen(pMFembedded, pTrackNew, &pTrackNew->ptrNew, &pMsgEmbedded->iMsgSize))
+        return false;
+
+      pMsgEmbedded->payload.pos = pTrackNew->ptrNew;
+      pMsgEmbedded->payload.size = pMsgEmbedded->iMsgSize;
       szEmbedded = pTrackNew->ptrNew - bptrEmbedded + pMsgEmbedded->iMsgSize;
 
-      if (_midiReadTrackCopyData(pMFembedded, pMsgEmbedded, pTrackNew->ptrNew, &szEmbedded, false) == false)
+      if (_midiReadTrackCopyData(pMFembedded, pTrackNew, pMsgEmbedded, pTrackNew->ptrNew, &szEmbedded, false) == false)
         return false;
 
       /* Now copy the data...*/
-      readChunkFromFile(pMFembedded->pFile, pMsgEmbedded->dataEmbedded, bptrEmbedded, szEmbedded);
+      readChunkFromTrack(pMFembedded, pTrackNew, pMsgEmbedded->dataEmbedded, bptrEmbedded, szEmbedded);
 
       /* Place the META data it in a neat structure also for embedded! */
       switch(pMsgEmbedded->MsgData.MetaEvent.iType) {
         case	metaSequenceNumber: {
               uint8_t tmpSequenceNumber;
-              readByteFromFile(pMFembedded->pFile, &tmpSequenceNumber, pTrackNew->ptrNew + 0);
+              readByteFromTrack(pMFembedded, pTrackNew, &tmpSequenceNumber, pTrackNew->ptrNew + 0);
               pMsgEmbedded->MsgData.MetaEvent.Data.iSequenceNumber = tmpSequenceNumber;
               break;
             }
@@ -437,14 +1448,15 @@ bool midiReadGetNextMessage(const MIDI_FILE* _pMFembedded, int32_t iTrack, MIDI_
         case	metaLyric:
         case	metaMarker:
         case	metaCuePoint:
-            pMsgEmbedded->MsgData.MetaEvent.Data.Text.strLen = szEmbedded - 3;
-            pMsgEmbedded->MsgData.MetaEvent.Data.Text.pData = pMsgEmbedded->dataEmbedded + 3;
+            // texts longer than the buffer are cut here, payload has them in full
+            pMsgEmbedded->MsgData.MetaEvent.Data.Text.strLen = szEmbedded - (pTrackNew->ptrNew - bptrEmbedded);
+            pMsgEmbedded->MsgData.MetaEvent.Data.Text.pData = pMsgEmbedded->dataEmbedded + (pTrackNew->ptrNew - bptrEmbedded);
             pMsgEmbedded->MsgData.MetaEvent.Data.Text.pData[pMsgEmbedded->MsgData.MetaEvent.Data.Text.strLen] = '\0'; // Add Null terminator
             break;
 
         case	metaMIDIPort: {
           uint8_t tmpMIDIPort;
-          readByteFromFile(pMFembedded->pFile, &tmpMIDIPort, pTrackNew->ptrNew + 0);
+          readByteFromTrack(pMFembedded, pTrackNew, &tmpMIDIPort, pTrackNew->ptrNew + 0);
           pMsgEmbedded->MsgData.MetaEvent.Data.iMIDIPort = tmpMIDIPort;
           break;
         }
@@ -453,7 +1465,7 @@ bool midiReadGetNextMessage(const MIDI_FILE* _pMFembedded, int32_t iTrack, MIDI_
             break;
         case	metaSetTempo: { // looks ok!
               uint8_t mpqn[3];
-              readChunkFromFile(pMFembedded->pFile, mpqn, pTrackNew->ptrNew, 3);
+              readChunkFromTrack(pMFembedded, pTrackNew, mpqn, pTrackNew->ptrNew, 3);
               int32_t iMPQN = (mpqn[0] << 16) | (mpqn[1] << 8) | mpqn[2];
               pMsgEmbedded->MsgData.MetaEvent.Data.Tempo.iBPM = MICROSECONDS_PER_MINUTE / iMPQN;
             }
@@ -461,7 +1473,7 @@ bool midiReadGetNextMessage(const MIDI_FILE* _pMFembedded, int32_t iTrack, MIDI_
         case	metaSMPTEOffset: {
             // embedded
             uint8_t tmpSMPTE[5];
-            readChunkFromFile(pMFembedded->pFile, tmpSMPTE, pTrackNew->ptrNew, 5);
+            readChunkFromTrack(pMFembedded, pTrackNew, tmpSMPTE, pTrackNew->ptrNew, 5);
             pMsgEmbedded->MsgData.MetaEvent.Data.SMPTE.iHours = tmpSMPTE[0];
             pMsgEmbedded->MsgData.MetaEvent.Data.SMPTE.iMins = tmpSMPTE[1];
             pMsgEmbedded->MsgData.MetaEvent.Data.SMPTE.iSecs = tmpSMPTE[2];
@@ -472,34 +1484,34 @@ bool midiReadGetNextMessage(const MIDI_FILE* _pMFembedded, int32_t iTrack, MIDI_
         case	metaTimeSig: {
             /* TODO: Variations without 24 & 8 */
             uint8_t tmpTimeSig[2];
-            readChunkFromFile(pMFembedded->pFile, tmpTimeSig, pTrackNew->ptrNew, 2);
+            readChunkFromTrack(pMFembedded, pTrackNew, tmpTimeSig, pTrackNew->ptrNew, 2);
             pMsgEmbedded->MsgData.MetaEvent.Data.TimeSig.iNom = tmpTimeSig[0];
             pMsgEmbedded->MsgData.MetaEvent.Data.TimeSig.iDenom = tmpTimeSig[1] * MIDI_NOTE_MINIM;
         }
             break;
         case	metaKeySig: { // TODO: check!
             uint8_t tmp;
-            readByteFromFile(pMFembedded->pFile, &tmp, pTrackNew->ptrNew);
+            readByteFromTrack(pMFembedded, pTrackNew, &tmp, pTrackNew->ptrNew);
 
             if (tmp & 0x80) {
               /* Do some trendy sign extending in reverse :) */
-              readByteFromFile(pMFembedded->pFile, &tmp, pTrackNew->ptrNew);
+              readByteFromTrack(pMFembedded, pTrackNew, &tmp, pTrackNew->ptrNew);
               pMsgEmbedded->MsgData.MetaEvent.Data.KeySig.iKey = (256 - tmp) & keyMaskKey;
               pMsgEmbedded->MsgData.MetaEvent.Data.KeySig.iKey |= keyMaskNeg;
             }
             else {
-              readByteFromFile(pMFembedded->pFile, &tmp, pTrackNew->ptrNew);
+              readByteFromTrack(pMFembedded, pTrackNew, &tmp, pTrackNew->ptrNew);
               pMsgEmbedded->MsgData.MetaEvent.Data.KeySig.iKey = (tMIDI_KEYSIG)(tmp & keyMaskKey);
             }
 
-            readByteFromFile(pMFembedded->pFile, &tmp, pTrackNew->ptrNew + 1);
+            readByteFromTrack(pMFembedded, pTrackNew, &tmp, pTrackNew->ptrNew + 1);
             if (tmp)
               pMsgEmbedded->MsgData.MetaEvent.Data.KeySig.iKey |= keyMaskMin; // TODO: check!
           }
           break;
         case	metaSequencerSpecific:
-          pMsgEmbedded->MsgData.MetaEvent.Data.Sequencer.iSize = pMsgEmbedded->iMsgSize;
-          pMsgEmbedded->MsgData.MetaEvent.Data.Sequencer.pData = pMsgEmbedded->dataEmbedded + 3;
+          pMsgEmbedded->MsgData.MetaEvent.Data.Sequencer.iSize = szEmbedded - (pTrackNew->ptrNew - bptrEmbedded);
+          pMsgEmbedded->MsgData.MetaEvent.Data.Sequencer.pData = pMsgEmbedded->dataEmbedded + (pTrackNew->ptrNew - bptrEmbedded);
           break;
       }
 
@@ -514,14 +1526,18 @@ bool midiReadGetNextMessage(const MIDI_FILE* _pMFembedded, int32_t iTrack, MIDI_
     case	msgSysEx2:
       bptrEmbedded = pTrackNew->ptrNew;
       pTrackNew->ptrNew += 1;
-      _midiReadVarLen(pMFembedded, &pTrackNew->ptrNew, &pMsgEmbedded->iMsgSize);
+      if (!_midiReadVarLen(pMFembedded, pTrackNew, &pTrackNew->ptrNew, &pMsgEmbedded->iMsgSize))
+        return false;
+
+      pMsgEmbedded->payload.pos = pTrackNew->ptrNew;
+      pMsgEmbedded->payload.size = pMsgEmbedded->iMsgSize;
       szEmbedded = (pTrackNew->ptrNew - bptrEmbedded) + pMsgEmbedded->iMsgSize;
 
-      if (_midiReadTrackCopyData(pMFembedded, pMsgEmbedded, pTrackNew->ptrNew, &szEmbedded, false) == false)
+      if (_midiReadTrackCopyData(pMFembedded, pTrackNew, pMsgEmbedded, pTrackNew->ptrNew, &szEmbedded, false) == false)
         return false;
 
       /* Embedded: Now copy the data */
-      readChunkFromFile(pMFembedded->pFile, pMsgEmbedded->dataEmbedded, bptrEmbedded, szEmbedded);
+      readChunkFromTrack(pMFembedded, pTrackNew, pMsgEmbedded->dataEmbedded, bptrEmbedded, szEmbedded);
       pTrackNew->ptrNew += pMsgEmbedded->iMsgSize;
       pMsgEmbedded->iMsgSize = szEmbedded;
       pMsgEmbedded->MsgData.SysEx.pData = pMsgEmbedded->dataEmbedded;
@@ -536,7 +1552,7 @@ bool midiReadGetNextMessage(const MIDI_FILE* _pMFembedded, int32_t iTrack, MIDI_
   pMsgEmbedded->bImpliedMsg = false;
   if ((pMsgEmbedded->iType & 0xf0) != 0xf0) {
     uint8_t tmpVal = 0;
-    readByteFromFile(pMFembedded->pFile, &tmpVal, pTrackNew->ptrNew);
+    readByteFromTrack(pMFembedded, pTrackNew, &tmpVal, pTrackNew->ptrNew);
     if (tmpVal & 0x80) {
     }
     else {
@@ -545,7 +1561,9 @@ bool midiReadGetNextMessage(const MIDI_FILE* _pMFembedded, int32_t iTrack, MIDI_
       pMsgEmbedded->iMsgSize--;
     }
 
-    _midiReadTrackCopyData(pMFembedded, pMsgEmbedded, pTrackNew->ptrNew, &pMsgEmbedded->iMsgSize, true);
+    szEmbedded = pMsgEmbedded->iMsgSize; // iMsgSize is no size_t, which is wider on 64 bit hosts
+    _midiReadTrackCopyData(pMFembedded, pTrackNew, pMsgEmbedded, pTrackNew->ptrNew, &szEmbedded, true);
+    pMsgEmbedded->iMsgSize = szEmbedded;
     pTrackNew->ptrNew += pMsgEmbedded->iMsgSize;
   }
 
@@ -557,14 +1575,1648 @@ void midiReadInitMessage(MIDI_MSG *pMsg) {
   pMsg->bImpliedMsg = false;
 }
 
+bool midiReadGetNextEvent(const MIDI_FILE* _pMFembedded, int32_t iTrack, MIDI_EVENT* pEvent) {
+  // Reads the next event of the track into the compact MIDI_EVENT. The running status is kept in the track, so the
+  // same track shouldn't be read with midiReadGetNextMessage() as well.
+  MIDI_FILE_TRACK* pTrack;
+  _MIDI_PEEKED_MSG peeked;
+  uint32_t dt, ptr;
+  uint8_t status = 0;
+
+  _VAR_CAST;
+  if (!IsTrackValid(iTrack) || !pEvent)			return false;
+
+  pTrack = &pMFembedded->Track[iTrack];
+  if (pTrack->ptrNew >= pTrack->pEndNew)
+    return false;
+
+  pEvent->track = (uint8_t)iTrack;
+  pEvent->payloadPos = 0;
+  pEvent->payloadSize = 0;
+
+  if (_midiPeekChannelMessage(pMFembedded, pTrack, pTrack->last_status, &peeked)) {
+    pTrack->pos += peeked.dt;
+    pTrack->ptrNew += peeked.numBytes;
+    pTrack->last_status = peeked.status;
+    pEvent->tick = pTrack->pos;
+    pEvent->status = peeked.status;
+    pEvent->data1 = peeked.pData[0];
+    pEvent->data2 = peeked.msgSize - (peeked.pData - peeked.pMsg) > 1 ? peeked.pData[1] : 0;
+    return true;
+  }
+
+  // Meta events, sysex and messages on the border of the cache are read byte by byte. The track only moves on once
+  // the event is complete, so an invalid one leaves it where it was. Like the fast path and midiStreamFeed(), an
+  // event cut off by the end of the track chunk is invalid.
+  ptr = pTrack->ptrNew;
+  if (!_midiReadVarLen(pMFembedded, pTrack, &ptr, &dt) || ptr >= pTrack->pEndNew ||
+      !readByteFromTrack(pMFembedded, pTrack, &status, ptr))
+    return false;
+
+  if (status & 0x80)
+    ptr++;
+  else if (pTrack->last_status)
+    status = pTrack->last_status;
+  else
+    return false; // data without a status to run on
+
+  pEvent->tick = pTrack->pos + dt;
+  pEvent->status = status;
+  pEvent->data1 = 0;
+  pEvent->data2 = 0;
+
+  if (status == msgMetaEvent || status == msgSysEx1 || status == msgSysEx2) {
+    if (status == msgMetaEvent) {
+      if (ptr >= pTrack->pEndNew || !readByteFromTrack(pMFembedded, pTrack, &pEvent->data1, ptr))
+        return false;
+      ptr++;
+    }
+
+    if (!_midiReadVarLen(pMFembedded, pTrack, &ptr, &pEvent->payloadSize) ||
+        pEvent->payloadSize > pTrack->pEndNew - ptr)
+      return false;
+
+    pEvent->payloadPos = ptr;
+    status = 0; // meta events and sysex cancel the running status
+    ptr += pEvent->payloadSize;
+  }
+  else if (status > msgSysEx1) {
+    hal_printfWarning("Warning, system common or realtime message in a track!\r\n");
+    return false;
+  }
+  else {
+    uint32_t numData = (status & 0xF0) == msgSetProgram || (status & 0xF0) == msgChangePressure ? 1 : 2;
+
+    if (numData > pTrack->pEndNew - ptr || !readByteFromTrack(pMFembedded, pTrack, &pEvent->data1, ptr) ||
+        (numData > 1 && !readByteFromTrack(pMFembedded, pTrack, &pEvent->data2, ptr + 1)))
+      return false;
+
+    ptr += numData;
+  }
+
+  pTrack->ptrNew = ptr;
+  pTrack->pos += dt;
+  pTrack->last_status = status;
+  return true;
+}
+
+uint32_t midiReadEventPayload(const MIDI_FILE* _pMFembedded, const MIDI_EVENT* pEvent, void* dst, uint32_t maxSize) {
+  // Copies up to maxSize bytes of the payload of a meta event or sysex. Returns the number of bytes copied.
+  MIDI_PAYLOAD payload;
+
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded) || !pEvent || !dst || !IsTrackValid(pEvent->track))
+    return 0;
+
+  payload.pos = pEvent->payloadPos;
+  payload.size = pEvent->payloadSize;
+  payload.iTrack = pEvent->track;
+  return midiReadCopyPayload(pMFembedded, &payload, 0, dst, maxSize);
+}
+
+uint32_t midiReadCopyPayload(const MIDI_FILE* _pMFembedded, const MIDI_PAYLOAD* pPayload, uint32_t offset, void* dst,
+    uint32_t maxSize) {
+  // Copies up to maxSize bytes of the payload, starting offset bytes into it. Returns the number of bytes copied, so
+  // big payloads can be fetched piece by piece into a small buffer.
+  uint32_t num;
+
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded) || !pPayload || !dst || !IsTrackValid(pPayload->iTrack) || offset >= pPayload->size)
+    return 0;
+
+  num = pPayload->size - offset < maxSize ? pPayload->size - offset : maxSize;
+  if (num == 0)
+    return 0;
+
+  // Through the track, the single window is in the same memory as the track windows
+  return readChunkFromTrack(pMFembedded, &pMFembedded->Track[pPayload->iTrack], dst, pPayload->pos + offset, num);
+}
+
+const uint8_t* midiReadGetPayloadData(const MIDI_FILE* _pMFembedded, const MIDI_PAYLOAD* pPayload) {
+  // Returns the payload without copying it, if the whole file is in memory (see midiFileOpenMemory()), otherwise NULL.
+  size_t num;
+
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded) || !pPayload || !pPayload->size || !pMFembedded->pMapped)
+    return NULL;
+
+  num = pPayload->size;
+  const uint8_t* pData = getChunkFromMapping(pMFembedded, pPayload->pos, &num);
+  return num == pPayload->size ? pData : NULL;
+}
+
+bool midiReadStreamPayload(const MIDI_FILE* _pMFembedded, const MIDI_PAYLOAD* pPayload,
+    OnPayloadChunkCallback_t pOnChunkCb, void* pUser) {
+  // Hands the payload to pOnChunkCb in pieces of at most PAYLOAD_CHUNK_SIZE bytes, or in one piece if the file is in
+  // memory. The pieces are only valid during the callback. Returns false, if the payload couldn't be read completely
+  // or the callback stopped it.
+  const uint8_t* pData;
+  uint8_t chunk[PAYLOAD_CHUNK_SIZE];
+  uint32_t offset, num;
+
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded) || !pPayload || !pOnChunkCb || !IsTrackValid(pPayload->iTrack))
+    return false;
+
+  if (pPayload->size == 0)
+    return true;
+
+  if ((pData = midiReadGetPayloadData(pMFembedded, pPayload)))
+    return pOnChunkCb(pData, pPayload->size, pUser);
+
+  for (offset = 0; offset < pPayload->size; offset += num) {
+    num = pPayload->size - offset < PAYLOAD_CHUNK_SIZE ? pPayload->size - offset : PAYLOAD_CHUNK_SIZE;
+
+    // straight out of the cache, if the piece is in there
+    pData = peekChunkFromTrack(pMFembedded, &pMFembedded->Track[pPayload->iTrack], pPayload->pos + offset, num);
+    if (!pData) {
+      if (midiReadCopyPayload(pMFembedded, pPayload, offset, chunk, num) != num)
+        return false;
+
+      pData = chunk;
+    }
+
+    if (!pOnChunkCb(pData, num, pUser))
+      return false;
+  }
+
+  return true;
+}
+
+static bool _midiEventIsBefore(const MIDI_EVENT* pEvent, const MIDI_EVENT* pOther) {
+  // Order of events from different tracks: by tick, meta events and sysex before channel messages of the same tick
+  // (like misc/mfc120.c merges the tracks), then by track.
+  bool bSys = pEvent->status >= msgSysEx1;
+  bool bOtherSys = pOther->status >= msgSysEx1;
+
+  if (pEvent->tick != pOther->tick)
+    return pEvent->tick < pOther->tick;
+
+  if (bSys != bOtherSys)
+    return bSys;
+
+  return pEvent->track < pOther->track;
+}
+
+static void _midiMergeSiftDown(MIDI_MERGE* pMerge, int32_t iNode) {
+  for (;;) {
+    int32_t iFirst = iNode;
+    uint8_t iTrack;
+
+    for (int32_t iChild = 2 * iNode + 1; iChild <= 2 * iNode + 2 && iChild < pMerge->heapSize; ++iChild)
+      if (_midiEventIsBefore(&pMerge->heads[pMerge->heap[iChild]], &pMerge->heads[pMerge->heap[iFirst]]))
+        iFirst = iChild;
+
+    if (iFirst == iNode)
+      return;
+
+    iTrack = pMerge->heap[iNode];
+    pMerge->heap[iNode] = pMerge->heap[iFirst];
+    pMerge->heap[iFirst] = iTrack;
+    iNode = iFirst;
+  }
+}
+
+bool midiReadInitMerge(const MIDI_FILE* _pMFembedded, MIDI_MERGE* pMerge) {
+  // Reads the next event of every track, to hand them back in global time order with midiReadGetNextMergedEvent().
+  // The tracks are read with midiReadGetNextEvent(), so they shouldn't be read otherwise until the merge is done.
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded) || !pMerge)
+    return false;
+
+  pMerge->heapSize = 0;
+  for (int iTrack = 0; iTrack < midiReadGetNumTracks(pMFembedded); ++iTrack)
+    if (midiReadGetNextEvent(pMFembedded, iTrack, &pMerge->heads[iTrack]))
+      pMerge->heap[pMerge->heapSize++] = (uint8_t)iTrack;
+
+  for (int32_t iNode = pMerge->heapSize / 2 - 1; iNode >= 0; --iNode)
+    _midiMergeSiftDown(pMerge, iNode);
+
+  return true;
+}
+
+bool midiReadGetNextMergedEvent(const MIDI_FILE* _pMFembedded, MIDI_MERGE* pMerge, MIDI_EVENT* pEvent) {
+  // Returns the next event of all tracks (see _midiEventIsBefore() for the order) in O(log tracks), or false when all
+  // tracks are read.
+  uint8_t iTrack;
+
+  if (!pMerge || !pEvent || pMerge->heapSize == 0)
+    return false;
+
+  iTrack = pMerge->heap[0];
+  *pEvent = pMerge->heads[iTrack];
+
+  // The track of the event reads its next one, which can only move down in the heap.
+  if (!midiReadGetNextEvent(_pMFembedded, iTrack, &pMerge->heads[iTrack]))
+    pMerge->heap[0] = pMerge->heap[--pMerge->heapSize];
+
+  _midiMergeSiftDown(pMerge, 0);
+  return true;
+}
+
+static void _midiRewindTrack(MIDI_FILE_TRACK* pTrack) {
+  pTrack->ptrNew = pTrack->pBaseNew + 8;
+  pTrack->pos = 0;
+  pTrack->last_status = 0;
+}
+
+static bool _midiTimelineAdd(_MIDI_FILE* pMFembedded, MIDI_TIMELINE* pTimeline, const MIDI_EVENT* pEvent) {
+  uint32_t iEvent = pTimeline->numEvents;
+
+  if (iEvent >= pTimeline->maxEvents || pEvent->payloadSize > pTimeline->maxArenaSize - pTimeline->arenaSize)
+    return false;
+
+  pTimeline->pTick[iEvent] = pEvent->tick;
+  pTimeline->pStatus[iEvent] = pEvent->status;
+  pTimeline->pData1[iEvent] = pEvent->data1;
+  pTimeline->pData2[iEvent] = pEvent->data2;
+  pTimeline->pTrack[iEvent] = pEvent->track;
+  pTimeline->pPayloadOffset[iEvent] = pTimeline->arenaSize;
+  pTimeline->pPayloadSize[iEvent] = midiReadEventPayload(pMFembedded, pEvent, &pTimeline->pArena[pTimeline->arenaSize],
+    pEvent->payloadSize);
+  pTimeline->arenaSize += pTimeline->pPayloadSize[iEvent];
+  pTimeline->numEvents++;
+  return true;
+}
+
+bool midiReadTimeline(MIDI_FILE* _pMFembedded, MIDI_TIMELINE* pTimeline) {
+  // Decodes all tracks from their start in one pass and merges them into the timeline. Afterwards all tracks are read
+  // to their end. Returns false, if the timeline is too small (see midiTimelineGetMaxSize()).
+  MIDI_MERGE merge;
+  MIDI_EVENT event;
+
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded) || !pTimeline)
+    return false;
+
+  for (int iTrack = 0; iTrack < midiReadGetNumTracks(pMFembedded); ++iTrack)
+    _midiRewindTrack(&pMFembedded->Track[iTrack]);
+
+  pTimeline->numEvents = 0;
+  pTimeline->arenaSize = 0;
+  midiReadInitMerge(pMFembedded, &merge);
+  while (midiReadGetNextMergedEvent(pMFembedded, &merge, &event))
+    if (!_midiTimelineAdd(pMFembedded, pTimeline, &event))
+      return false;
+
+  return true;
+}
+
+typedef struct {
+  _MIDI_FILE* pMF;
+  MIDI_EVENT* pEvents[MAX_MIDI_TRACKS]; // in the scratch buffer of midiReadTimelineParallel()
+  uint32_t maxEvents[MAX_MIDI_TRACKS];
+  uint32_t numEvents[MAX_MIDI_TRACKS];
+} _MIDI_TRACK_EVENTS;
+
+static void _midiReadTrackEventsJob(void* pArg, int32_t iTrack) {
+  // Decodes one track from its start. Jobs of different tracks only share the file, which is in memory.
+  _MIDI_TRACK_EVENTS* pTracks = pArg;
+  MIDI_FILE_TRACK* pTrack = &pTracks->pMF->Track[iTrack];
+  uint32_t num = 0;
+
+  _midiRewindTrack(pTrack);
+  while (num < pTracks->maxEvents[iTrack] && midiReadGetNextEvent(pTracks->pMF, iTrack, &pTracks->pEvents[iTrack][num]))
+    num++;
+
+  pTracks->numEvents[iTrack] = num;
+}
+
+bool midiReadTimelineParallel(MIDI_FILE* _pMFembedded, MIDI_TIMELINE* pTimeline, void* pScratch, uint32_t scratchSize) {
+  // Same as midiReadTimeline(), but every track is decoded on its own into pScratch first, which takes
+  // sizeof(MIDI_EVENT) Bytes for each event of midiTimelineGetMaxSize() (aligned to 4 bytes). With MIDI_PARALLEL the
+  // tracks of files in memory are decoded on several cores. Then the track arrays are merged into the timeline.
+  // Returns false, if pScratch or the timeline is too small.
+  _MIDI_TRACK_EVENTS tracks;
+  MIDI_MERGE merge;
+  uint32_t cursor[MAX_MIDI_TRACKS];
+  uint32_t numLeft = scratchSize / sizeof(MIDI_EVENT);
+  MIDI_EVENT* pNext = pScratch;
+  int32_t numTracks;
+  uint8_t iTrack;
+
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded) || !pTimeline || !pScratch)
+    return false;
+
+  numTracks = midiReadGetNumTracks(pMFembedded);
+  tracks.pMF = pMFembedded;
+  for (int i = 0; i < numTracks; ++i) {
+    tracks.maxEvents[i] = pMFembedded->Track[i].sz / 2; // like midiTimelineGetMaxSize()
+    if (tracks.maxEvents[i] > numLeft)
+      return false;
+
+    tracks.pEvents[i] = pNext;
+    pNext += tracks.maxEvents[i];
+    numLeft -= tracks.maxEvents[i];
+  }
+
+#ifdef MIDI_PARALLEL
+  if (pMFembedded->pMapped)
+    hal_runParallel(_midiReadTrackEventsJob, &tracks, numTracks);
+  else // the tracks share the cache
+#endif
+  for (int i = 0; i < numTracks; ++i)
+    _midiReadTrackEventsJob(&tracks, i);
+
+  // k-way merge of the tracks, in the same order as midiReadGetNextMergedEvent()
+  merge.heapSize = 0;
+  for (int i = 0; i < numTracks; ++i) {
+    cursor[i] = 0;
+    if (tracks.numEvents[i] > 0) {
+      merge.heads[i] = tracks.pEvents[i][0];
+      merge.heap[merge.heapSize++] = (uint8_t)i;
+    }
+  }
+
+  for (int32_t iNode = merge.heapSize / 2 - 1; iNode >= 0; --iNode)
+    _midiMergeSiftDown(&merge, iNode);
+
+  pTimeline->numEvents = 0;
+  pTimeline->arenaSize = 0;
+  while (merge.heapSize > 0) {
+    iTrack = merge.heap[0];
+    if (!_midiTimelineAdd(pMFembedded, pTimeline, &merge.heads[iTrack]))
+      return false;
+
+    if (++cursor[iTrack] < tracks.numEvents[iTrack])
+      merge.heads[iTrack] = tracks.pEvents[iTrack][cursor[iTrack]];
+    else
+      merge.heap[0] = merge.heap[--merge.heapSize];
+
+    _midiMergeSiftDown(&merge, 0);
+  }
+
+  return true;
+}
+
+uint32_t midiFileBuildSeekIndex(MIDI_FILE* _pMFembedded, MIDI_SEEK_POINT* pPoints, uint32_t maxPoints,
+    uint32_t interval) {
+  // Walks all tracks once and sets a checkpoint about every interval ticks (0: every 4 quarter notes) for
+  // midiReadSeek(). Every track gets its checkpoint at tick 0, if maxPoints is at least the number of tracks, otherwise
+  // no track has an index. The rest of pPoints is shared out by the track sizes. A track which needs more drops every
+  // other checkpoint and doubles its interval, so the index never takes more than maxPoints. Afterwards all tracks are
+  // at their start. Returns the number of checkpoints used.
+  MIDI_INDEX_BUILD build;
+
+  memset(&build, 0, sizeof(build));
+  build.pSeekPoints = pPoints;
+  build.maxSeekPoints = maxPoints;
+  build.seekInterval = interval;
+  if (!midiFileBuildIndex(_pMFembedded, &build))
+    return 0;
+
+  return build.numSeekPoints;
+}
+
+bool midiReadSeek(const MIDI_FILE* _pMFembedded, int32_t iTrack, uint32_t tick, MIDI_MSG* pMsgEmbedded) {
+  // Moves the track to its first event at or after tick, so that is read next. With a seek index this is a binary
+  // search and a short skip, otherwise the track is skipped from its start. For midiReadGetNextMessage() the running
+  // status is handed to pMsgEmbedded, for midiReadGetNextEvent() it can be NULL.
+  MIDI_FILE_TRACK* pTrack;
+  MIDI_EVENT event;
+  uint32_t ptr, pos;
+  uint8_t status, msgStatus = 0;
+
+  _VAR_CAST;
+  if (!IsTrackValid(iTrack))
+    return false;
+
+  pTrack = &pMFembedded->Track[iTrack];
+  _midiRewindTrack(pTrack);
+  if (pTrack->numSeekPoints > 0) {
+    // last checkpoint before tick; events of the tick itself may come before a checkpoint right on it
+    uint32_t iLow = 0, iHigh = pTrack->numSeekPoints;
+    while (iHigh - iLow > 1) {
+      uint32_t iMid = (iLow + iHigh) / 2;
+      if (pTrack->pSeekPoints[iMid].tick < tick)
+        iLow = iMid;
+      else
+        iHigh = iMid;
+    }
+
+    pTrack->pos = pTrack->pSeekPoints[iLow].tick;
+    pTrack->ptrNew = pTrack->pSeekPoints[iLow].ptr;
+    pTrack->last_status = pTrack->pSeekPoints[iLow].status;
+    msgStatus = pTrack->pSeekPoints[iLow].msgStatus;
+  }
+
+  for (;;) {
+    ptr = pTrack->ptrNew;
+    pos = pTrack->pos;
+    status = pTrack->last_status;
+    if (!midiReadGetNextEvent(pMFembedded, iTrack, &event))
+      break; // tick is behind the end of the track
+
+    if (event.tick >= tick) {
+      pTrack->ptrNew = ptr;
+      pTrack->pos = pos;
+      pTrack->last_status = status;
+      break;
+    }
+
+    msgStatus = event.status;
+  }
+
+  // midiReadGetNextMessage() keeps sysex and meta events as the last message type, and the channel of any status
+  if (pMsgEmbedded) {
+    pMsgEmbedded->iLastMsgType = (tMIDI_MSG)(msgStatus < msgSysEx1 ? msgStatus & 0xF0 : msgStatus);
+    pMsgEmbedded->iLastMsgChnl = (msgStatus & 0x0f) + 1;
+  }
+
+  return true;
+}
+
+static void _midiChaseApply(MIDI_CHASE_SNAPSHOT* pState, const MIDI_EVENT* pEvent) {
+  MIDI_CHANNEL_STATE* pChannel = &pState->channel[pEvent->status & 0x0F];
+
+  switch (pEvent->status & 0xF0) {
+    case msgControlChange:
+      pChannel->controller[pEvent->data1 & 0x7F] = pEvent->data2;
+      break;
+    case msgSetProgram:
+      pChannel->program = pEvent->data1;
+      break;
+    case msgChangePressure:
+      pChannel->pressure = pEvent->data1;
+      break;
+    case msgSetPitchWheel:
+      pChannel->pitchWheel = (uint16_t)(pEvent->data1 | (pEvent->data2 << 7));
+      break;
+    default:
+      break;
+  }
+}
+
+uint32_t midiFileBuildChaseIndex(MIDI_FILE* _pMFembedded, MIDI_CHASE_SNAPSHOT* pSnapshots, uint32_t maxSnapshots,
+    uint32_t interval) {
+  // Walks all tracks once in time order and keeps a snapshot of the channel state about every interval ticks
+  // (0: every 4 quarter notes, like the seek index) for midiReadChase(). If there are more than maxSnapshots, every
+  // other one is dropped and the interval doubled. Afterwards all tracks are at their start. Returns the number of
+  // snapshots used.
+  MIDI_INDEX_BUILD build;
+
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded))
+    return 0;
+
+  pMFembedded->pChaseSnapshots = NULL;
+  pMFembedded->numChaseSnapshots = 0;
+  if (!pSnapshots || maxSnapshots < 2)
+    return 0;
+
+  memset(&build, 0, sizeof(build));
+  build.pChaseSnapshots = pSnapshots;
+  build.maxChaseSnapshots = maxSnapshots;
+  build.chaseInterval = interval;
+  midiFileBuildIndex(pMFembedded, &build);
+  return build.numChaseSnapshots;
+}
+
+bool midiReadChase(const MIDI_FILE* _pMFembedded, uint32_t tick, MIDI_CHASE_SNAPSHOT* pState) {
+  // Fills pState with the channel state at tick and moves all tracks there (see midiReadSeek()), so a player can
+  // resend the state and play on. With a chase index this is one snapshot and the events after it, otherwise all
+  // events before tick are replayed. The tracks are moved with midiReadSeek(), so a seek index keeps this short too.
+  MIDI_MERGE merge;
+  MIDI_EVENT event;
+  uint32_t fromTick = 0;
+
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded) || !pState)
+    return false;
+
+  memset(pState, MIDI_CHANNEL_UNSET, sizeof(MIDI_CHASE_SNAPSHOT));
+  if (pMFembedded->numChaseSnapshots > 0 && pMFembedded->pChaseSnapshots[0].tick <= tick) {
+    // last snapshot at or before tick
+    uint32_t iLow = 0, iHigh = pMFembedded->numChaseSnapshots;
+    while (iHigh - iLow > 1) {
+      uint32_t iMid = (iLow + iHigh) / 2;
+      if (pMFembedded->pChaseSnapshots[iMid].tick <= tick)
+        iLow = iMid;
+      else
+        iHigh = iMid;
+    }
+
+    *pState = pMFembedded->pChaseSnapshots[iLow];
+    fromTick = pState->tick;
+  }
+
+  for (int iTrack = 0; iTrack < midiReadGetNumTracks(pMFembedded); ++iTrack)
+    midiReadSeek(pMFembedded, iTrack, fromTick, NULL);
+
+  if (fromTick < tick) {
+    midiReadInitMerge(pMFembedded, &merge);
+    while (midiReadGetNextMergedEvent(pMFembedded, &merge, &event) && event.tick < tick)
+      _midiChaseApply(pState, &event);
+
+    for (int iTrack = 0; iTrack < midiReadGetNumTracks(pMFembedded); ++iTrack)
+      midiReadSeek(pMFembedded, iTrack, tick, NULL);
+  }
+
+  pState->tick = tick;
+  return true;
+}
+
+// Layout of the index midiFileSaveIndex() writes: the header, one _MIDI_INDEX_TRACK per track, then the seek points
+// of all tracks, the tempo points and the bar points, each starting at a multiple of 8 bytes. Values are stored as
+// they are in memory, so the index is only valid for the build of the library which wrote it.
+#define MIDI_INDEX_MAGIC	0x5844494DUL // "MIDX" on little endian machines, swapped on big endian ones
+#define MIDI_INDEX_ALIGN(size)	(((size) + 7) & ~7UL)
+#define MIDI_INDEX_FLAG_FAST_KEY	0x0001 // the key is a hash of the chunk headers only, see _midiFileGetIndexKey()
+
+typedef struct {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t numTracks;
+  uint64_t key;         // see _midiFileGetIndexKey()
+  uint32_t fileSize;    // up to the end of the last track
+  uint32_t size;        // of the whole index
+  uint16_t PPQN;
+  uint16_t sizeOfPoints; // sizeof() of the seek, tempo and bar points, 5 bits each
+  uint32_t numTempoPoints;
+  uint32_t numBarPoints;
+  uint32_t lastTick;    // see midiReadGetLastTick()
+  uint64_t duration;    // see midiReadGetDuration()
+  uint32_t flags;       // MIDI_INDEX_FLAG_*
+  uint32_t reserved;
+} _MIDI_INDEX_HEADER;
+
+typedef struct {
+  uint32_t start;       // file position of the track data
+  uint32_t size;
+  uint32_t numSeekPoints;
+  uint32_t numEvents;
+} _MIDI_INDEX_TRACK;
+
+#define MIDI_INDEX_SIZE_OF_POINTS	(uint16_t)(sizeof(MIDI_SEEK_POINT) | (sizeof(MIDI_TEMPO_POINT) << 5) | (sizeof(MIDI_BAR_POINT) << 10))
+
+static uint32_t _midiFileGetDataSize(const _MIDI_FILE* pMF) {
+  // Bytes of the file up to the end of the last track
+  int32_t numTracks = midiReadGetNumTracks(pMF);
+  return numTracks > 0 ? pMF->Track[numTracks - 1].pEndNew : pMF->Header.iHeaderSize + 8;
+}
+
+static uint64_t _midiFileHashRange(_MIDI_FILE* pMF, uint64_t hash, uint32_t pos, uint32_t endPos, bool bCached) {
+  // FNV-1a of the bytes from pos to endPos. Uncached reads leave the windows alone, for a few bytes here and there.
+  uint8_t buffer[256];
+
+  while (pos < endPos) {
+    uint32_t num = endPos - pos < sizeof(buffer) ? endPos - pos : sizeof(buffer);
+
+    if (bCached || pMF->pMapped) {
+      num = (uint32_t)readChunkFromFile(pMF, buffer, pos, num);
+    } else {
+#ifdef MIDI_READ_AHEAD
+      _midiCacheWaitForSource(pMF);
+#endif
+      num = (uint32_t)_midiCacheFetch(pMF, buffer, pos, num);
+    }
+    if (num == 0)
+      break;
+
+    for (uint32_t i = 0; i < num; ++i)
+      hash = (hash ^ buffer[i]) * 0x100000001B3ULL;
+    pos += num;
+  }
+
+  return hash;
+}
+
+static uint64_t _midiFileGetIndexKey(_MIDI_FILE* pMF, bool bFast) {
+  // Hash of the whole file, so an index isn't used with a file which was changed since it was saved. bFast only
+  // hashes the file header and the chunk headers of all tracks. That's a few small reads instead of all of the file,
+  // but it misses events changed in place.
+  uint64_t key = 0xCBF29CE484222325ULL;
+  uint32_t fileSize = pMF->source.pFuncs->size(&pMF->source);
+  uint32_t size = _midiFileGetDataSize(pMF);
+
+  if (fileSize > 0 && size > fileSize)
+    size = fileSize;
+
+  if (!bFast)
+    return _midiFileHashRange(pMF, key, 0, size, true);
+
+  key = _midiFileHashRange(pMF, key, 0, pMF->Header.iHeaderSize + 8, false);
+  for (int iTrack = 0; iTrack < midiReadGetNumTracks(pMF); ++iTrack)
+    key = _midiFileHashRange(pMF, key, pMF->Track[iTrack].pBaseNew, pMF->Track[iTrack].pBaseNew + 8, false);
+
+  return key;
+}
+
+static uint32_t _midiIndexGetLayout(const _MIDI_INDEX_HEADER* pHeader, uint32_t numSeekPoints, uint32_t* pSeekOffset,
+    uint32_t* pTempoOffset, uint32_t* pBarOffset) {
+  // Returns the size of the index
+  *pSeekOffset = MIDI_INDEX_ALIGN(sizeof(_MIDI_INDEX_HEADER) + pHeader->numTracks * sizeof(_MIDI_INDEX_TRACK));
+  *pTempoOffset = MIDI_INDEX_ALIGN(*pSeekOffset + numSeekPoints * sizeof(MIDI_SEEK_POINT));
+  *pBarOffset = MIDI_INDEX_ALIGN(*pTempoOffset + pHeader->numTempoPoints * sizeof(MIDI_TEMPO_POINT));
+  return MIDI_INDEX_ALIGN(*pBarOffset + pHeader->numBarPoints * sizeof(MIDI_BAR_POINT));
+}
+
+static bool _midiIndexCheckSeekPoints(const MIDI_FILE_TRACK* pTrack, const MIDI_SEEK_POINT* pPoints, uint32_t num) {
+  // Every checkpoint has to be inside of the track, and their ticks must not go back. The checkpoint at tick 0 of an
+  // empty track is at its end.
+  for (uint32_t i = 0; i < num; ++i)
+    if (pPoints[i].ptr < pTrack->pBaseNew + 8 || pPoints[i].ptr > pTrack->pEndNew ||
+        (pPoints[i].ptr == pTrack->pEndNew && pTrack->sz > 0) || (i > 0 && pPoints[i].tick < pPoints[i - 1].tick))
+      return false;
+
+  return true;
+}
+
+static bool _midiIndexCheckTempoPoints(const MIDI_TEMPO_POINT* pPoints, uint32_t num) {
+  // The map starts at tick 0, its ticks go up and its time doesn't go back. A tempo of 0 would stop the song.
+  for (uint32_t i = 0; i < num; ++i)
+    if (pPoints[i].usPerQuarter == 0 || (i == 0 && pPoints[i].tick != 0) ||
+        (i > 0 && (pPoints[i].tick <= pPoints[i - 1].tick || pPoints[i].us < pPoints[i - 1].us)))
+      return false;
+
+  return true;
+}
+
+static bool _midiIndexCheckBarPoints(const MIDI_BAR_POINT* pPoints, uint32_t num) {
+  // The map starts at tick 0, its ticks go up and its bars don't go back. Bars and beats can't be empty, as positions
+  // are divided by them.
+  for (uint32_t i = 0; i < num; ++i)
+    if (pPoints[i].nom == 0 || pPoints[i].ticksPerBeat == 0 || (i == 0 && pPoints[i].tick != 0) ||
+        (i > 0 && (pPoints[i].tick <= pPoints[i - 1].tick || pPoints[i].bar < pPoints[i - 1].bar)))
+      return false;
+
+  return true;
+}
+
+uint32_t midiFileSaveIndex(const MIDI_FILE* _pMFembedded, const MIDI_TEMPO_MAP* pTempoMap, const MIDI_BAR_MAP* pBarMap,
+    void* pBuffer, uint32_t bufferSize) {
+  // Writes the seek index (see midiFileBuildSeekIndex()), the event counts, the length of the song and the maps,
+  // which may be NULL, to pBuffer, so the caller can keep them in a sidecar file and skip building them the next time
+  // (see midiFileLoadIndex()). Returns the size of the index, it's only written if that's not more than bufferSize
+  // (0 finds out the size). Returns 0 on errors.
+  _MIDI_INDEX_HEADER header;
+  _MIDI_INDEX_TRACK* pTracks;
+  uint32_t numSeekPoints = 0, seekOffset, tempoOffset, barOffset, size;
+  uint8_t* pIndex = (uint8_t*)pBuffer;
+
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded) || pMFembedded->bOpenForWriting)
+    return 0;
+
+  memset(&header, 0, sizeof(header));
+  header.magic = MIDI_INDEX_MAGIC;
+  header.version = MIDI_INDEX_VERSION;
+  header.numTracks = (uint16_t)midiReadGetNumTracks(pMFembedded);
+  header.fileSize = _midiFileGetDataSize(pMFembedded);
+  header.PPQN = pMFembedded->Header.PPQN;
+  header.sizeOfPoints = MIDI_INDEX_SIZE_OF_POINTS;
+  header.numTempoPoints = pTempoMap ? pTempoMap->numPoints : 0;
+  header.numBarPoints = pBarMap ? pBarMap->numPoints : 0;
+  header.lastTick = pMFembedded->lastTick;
+  header.duration = pTempoMap ? midiTempoMapTickToUs(pTempoMap, header.lastTick) : pMFembedded->duration;
+#ifdef MIDI_INDEX_FAST_KEY
+  header.flags = MIDI_INDEX_FLAG_FAST_KEY;
+#endif
+  for (int iTrack = 0; iTrack < header.numTracks; ++iTrack)
+    numSeekPoints += pMFembedded->Track[iTrack].numSeekPoints;
+
+  size = _midiIndexGetLayout(&header, numSeekPoints, &seekOffset, &tempoOffset, &barOffset);
+  if (!pIndex || size > bufferSize)
+    return size;
+
+  memset(pIndex, 0, size);
+  header.size = size;
+  header.key = _midiFileGetIndexKey(pMFembedded, header.flags & MIDI_INDEX_FLAG_FAST_KEY);
+  memcpy(pIndex, &header, sizeof(header));
+
+  pTracks = (_MIDI_INDEX_TRACK*)(pIndex + sizeof(_MIDI_INDEX_HEADER));
+  numSeekPoints = 0;
+  for (int iTrack = 0; iTrack < header.numTracks; ++iTrack) {
+    const MIDI_FILE_TRACK* pTrack = &pMFembedded->Track[iTrack];
+
+    pTracks[iTrack].start = pTrack->pBaseNew;
+    pTracks[iTrack].size = pTrack->sz;
+    pTracks[iTrack].numSeekPoints = pTrack->numSeekPoints;
+    pTracks[iTrack].numEvents = pTrack->numEvents;
+    if (pTrack->numSeekPoints > 0)
+      memcpy(pIndex + seekOffset + numSeekPoints * sizeof(MIDI_SEEK_POINT), pTrack->pSeekPoints,
+          pTrack->numSeekPoints * sizeof(MIDI_SEEK_POINT));
+    numSeekPoints += pTrack->numSeekPoints;
+  }
+
+  if (header.numTempoPoints > 0)
+    memcpy(pIndex + tempoOffset, pTempoMap->pPoints, header.numTempoPoints * sizeof(MIDI_TEMPO_POINT));
+  if (header.numBarPoints > 0)
+    memcpy(pIndex + barOffset, pBarMap->pPoints, header.numBarPoints * sizeof(MIDI_BAR_POINT));
+
+  return size;
+}
+
+bool midiFileLoadIndex(MIDI_FILE* _pMFembedded, const void* pIndex, uint32_t size, MIDI_TEMPO_MAP* pTempoMap,
+    MIDI_BAR_MAP* pBarMap) {
+  // Takes over an index written by midiFileSaveIndex(), if it belongs to this file, and returns false otherwise.
+  // Nothing is copied: the seek index and the maps (either may be NULL) point into pIndex, which must stay valid
+  // while the file is open and start at a multiple of 8 bytes. A mapped sidecar file (see hal_fmap()) can be used as
+  // it is. The index is only read. Without MIDI_INDEX_FAST_KEY, only indexes keyed on the whole file are taken, which
+  // reads all of it.
+  const _MIDI_INDEX_HEADER* pHeader = (const _MIDI_INDEX_HEADER*)pIndex;
+  const _MIDI_INDEX_TRACK* pTracks;
+  const MIDI_SEEK_POINT* pSeekPoints;
+  const uint8_t* pData = (const uint8_t*)pIndex;
+  uint32_t numSeekPoints = 0, seekOffset, tempoOffset, barOffset;
+
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded) || !pIndex || ((uintptr_t)pIndex & 7) || size < sizeof(_MIDI_INDEX_HEADER))
+    return false;
+
+  if (pHeader->magic != MIDI_INDEX_MAGIC || pHeader->version != MIDI_INDEX_VERSION || pHeader->size != size ||
+      pHeader->sizeOfPoints != MIDI_INDEX_SIZE_OF_POINTS || pHeader->fileSize != _midiFileGetDataSize(pMFembedded) ||
+      pHeader->numTracks != midiReadGetNumTracks(pMFembedded) || pHeader->PPQN != pMFembedded->Header.PPQN ||
+      size < sizeof(_MIDI_INDEX_HEADER) + pHeader->numTracks * sizeof(_MIDI_INDEX_TRACK))
+    return false;
+
+#ifndef MIDI_INDEX_FAST_KEY
+  if (pHeader->flags & MIDI_INDEX_FLAG_FAST_KEY)
+    return false;
+#endif
+
+  pTracks = (const _MIDI_INDEX_TRACK*)(pData + sizeof(_MIDI_INDEX_HEADER));
+  for (int iTrack = 0; iTrack < pHeader->numTracks; ++iTrack) {
+    if (pTracks[iTrack].start != pMFembedded->Track[iTrack].pBaseNew ||
+        pTracks[iTrack].size != pMFembedded->Track[iTrack].sz ||
+        pTracks[iTrack].numSeekPoints > size / sizeof(MIDI_SEEK_POINT))
+      return false;
+    numSeekPoints += pTracks[iTrack].numSeekPoints;
+  }
+
+  if (pHeader->numTempoPoints > size / sizeof(MIDI_TEMPO_POINT) || pHeader->numBarPoints > size / sizeof(MIDI_BAR_POINT) ||
+      numSeekPoints > size / sizeof(MIDI_SEEK_POINT) ||
+      _midiIndexGetLayout(pHeader, numSeekPoints, &seekOffset, &tempoOffset, &barOffset) != size)
+    return false;
+
+  pSeekPoints = (const MIDI_SEEK_POINT*)(pData + seekOffset);
+  numSeekPoints = 0;
+  for (int iTrack = 0; iTrack < pHeader->numTracks; ++iTrack) {
+    if (!_midiIndexCheckSeekPoints(&pMFembedded->Track[iTrack], pSeekPoints + numSeekPoints,
+        pTracks[iTrack].numSeekPoints))
+      return false;
+    numSeekPoints += pTracks[iTrack].numSeekPoints;
+  }
+
+  if (!_midiIndexCheckTempoPoints((const MIDI_TEMPO_POINT*)(pData + tempoOffset), pHeader->numTempoPoints) ||
+      !_midiIndexCheckBarPoints((const MIDI_BAR_POINT*)(pData + barOffset), pHeader->numBarPoints))
+    return false;
+
+  // last, as it reads the file
+  if (pHeader->key != _midiFileGetIndexKey(pMFembedded, pHeader->flags & MIDI_INDEX_FLAG_FAST_KEY))
+    return false;
+
+  numSeekPoints = 0;
+  for (int iTrack = 0; iTrack < pHeader->numTracks; ++iTrack) {
+    MIDI_FILE_TRACK* pTrack = &pMFembedded->Track[iTrack];
+
+    pTrack->numSeekPoints = pTracks[iTrack].numSeekPoints;
+    pTrack->pSeekPoints = pTrack->numSeekPoints ? pSeekPoints + numSeekPoints : NULL;
+    pTrack->numEvents = pTracks[iTrack].numEvents;
+    numSeekPoints += pTrack->numSeekPoints;
+  }
+
+  pMFembedded->lastTick = pHeader->lastTick;
+  pMFembedded->duration = pHeader->duration;
+
+  if (pTempoMap) {
+    memset(pTempoMap, 0, sizeof(MIDI_TEMPO_MAP));
+    pTempoMap->pPoints = (const MIDI_TEMPO_POINT*)(pData + tempoOffset);
+    pTempoMap->numPoints = pTempoMap->maxPoints = pHeader->numTempoPoints;
+    pTempoMap->PPQN = pHeader->PPQN;
+    pTempoMap->lastTick = pHeader->lastTick;
+  }
+
+  if (pBarMap) {
+    memset(pBarMap, 0, sizeof(MIDI_BAR_MAP));
+    pBarMap->pPoints = (const MIDI_BAR_POINT*)(pData + barOffset);
+    pBarMap->numPoints = pBarMap->maxPoints = pHeader->numBarPoints;
+    pBarMap->PPQN = pHeader->PPQN;
+  }
+
+  return true;
+}
+
+/*
+** midiTimeline* Functions
+*/
+uint32_t midiTimelineGetMaxSize(const MIDI_FILE* _pMFembedded, uint32_t* pMaxEvents, uint32_t* pMaxArenaSize) {
+  // Returns the size of a buffer for midiTimelineInit(), which is big enough for any song of this file. The bounds
+  // come from the track sizes: every event takes at least 2 bytes, and payloads can't be larger than their track.
+  uint32_t maxEvents = 0;
+  uint32_t maxArenaSize = 0;
+
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded))
+    return 0;
+
+  for (int iTrack = 0; iTrack < midiReadGetNumTracks(pMFembedded); ++iTrack) {
+    maxEvents += pMFembedded->Track[iTrack].sz / 2;
+    maxArenaSize += pMFembedded->Track[iTrack].sz;
+  }
+
+  if (pMaxEvents)
+    *pMaxEvents = maxEvents;
+
+  if (pMaxArenaSize)
+    *pMaxArenaSize = maxArenaSize;
+
+  return maxEvents * MIDI_TIMELINE_BYTES_PER_EVENT + maxArenaSize;
+}
+
+bool midiTimelineInit(MIDI_TIMELINE* pTimeline, void* pBuffer, uint32_t bufferSize, uint32_t maxEvents) {
+  // Splits pBuffer (aligned to 4 bytes) into the arrays for maxEvents events. The rest of it becomes the arena.
+  uint8_t* p = pBuffer;
+
+  if (!pTimeline || !pBuffer || bufferSize / MIDI_TIMELINE_BYTES_PER_EVENT < maxEvents)
+    return false;
+
+  memset(pTimeline, 0, sizeof(MIDI_TIMELINE));
+  pTimeline->pTick = (uint32_t*)p;
+  p += maxEvents * sizeof(uint32_t);
+  pTimeline->pPayloadOffset = (uint32_t*)p;
+  p += maxEvents * sizeof(uint32_t);
+  pTimeline->pPayloadSize = (uint32_t*)p;
+  p += maxEvents * sizeof(uint32_t);
+  pTimeline->pStatus = p;
+  p += maxEvents;
+  pTimeline->pData1 = p;
+  p += maxEvents;
+  pTimeline->pData2 = p;
+  p += maxEvents;
+  pTimeline->pTrack = p;
+  p += maxEvents;
+
+  pTimeline->maxEvents = maxEvents;
+  pTimeline->pArena = p;
+  pTimeline->maxArenaSize = bufferSize - maxEvents * MIDI_TIMELINE_BYTES_PER_EVENT;
+  return true;
+}
+
+void midiFilterInit(MIDI_FILTER* pFilter, bool bAll) {
+  memset(pFilter, bAll ? 0xff : 0, sizeof(MIDI_FILTER));
+}
+
+void midiFilterSetMsg(MIDI_FILTER* pFilter, tMIDI_MSG iType, bool bWanted) {
+  // Channel message types, or msgSysEx1 / msgSysEx2 for all sysex. Meta events go through midiFilterSetMeta().
+  if (bWanted)
+    pFilter->msgMask |= MIDI_FILTER_MSG(iType);
+  else
+    pFilter->msgMask &= ~MIDI_FILTER_MSG(iType);
+}
+
+void midiFilterSetMeta(MIDI_FILTER* pFilter, tMIDI_META iType, bool bWanted) {
+  if (bWanted)
+    pFilter->metaMask[(iType >> 3) & 0x0f] |= 1 << (iType & 0x07);
+  else
+    pFilter->metaMask[(iType >> 3) & 0x0f] &= ~(1 << (iType & 0x07));
+}
+
+/*
+** midiTempoMap* Functions
+*/
+#define MIDI_US_PER_QUARTER_DEFAULT	(MICROSECONDS_PER_MINUTE / MIDI_BPM_DEFAULT)
+
+static uint64_t _midiTempoMapTicksToUs(const MIDI_TEMPO_MAP* pMap, const MIDI_TEMPO_POINT* pPoint, uint32_t tick) {
+  return pPoint->us + (uint64_t)(tick - pPoint->tick) * pPoint->usPerQuarter / pMap->PPQN;
+}
+
+uint32_t midiTempoMapBuild(MIDI_FILE* _pMFembedded, MIDI_TEMPO_MAP* pMap, MIDI_TEMPO_POINT* pPoints,
+    uint32_t maxPoints) {
+  // Collects the tempo changes of all tracks in one merged pass. Until the first one, the song runs at
+  // MIDI_BPM_DEFAULT. Returns the number of points the song needs, the map is only complete if that's not more than
+  // maxPoints (0 finds out the size). Afterwards all tracks are at their start.
+  MIDI_INDEX_BUILD build;
+
+  memset(&build, 0, sizeof(build));
+  build.pTempoMap = pMap;
+  build.pTempoPoints = pPoints;
+  build.maxTempoPoints = maxPoints;
+  if (!midiFileBuildIndex(_pMFembedded, &build))
+    return 0;
+
+  return build.numTempoPoints;
+}
+
+uint64_t midiTempoMapTickToUs(const MIDI_TEMPO_MAP* pMap, uint32_t tick) {
+  uint32_t iLow = 0, iHigh;
+
+  if (!pMap || pMap->numPoints == 0)
+    return 0;
+
+  // last point at or before tick
+  iHigh = pMap->numPoints;
+  while (iHigh - iLow > 1) {
+    uint32_t iMid = (iLow + iHigh) / 2;
+    if (pMap->pPoints[iMid].tick <= tick)
+      iLow = iMid;
+    else
+      iHigh = iMid;
+  }
+
+  return _midiTempoMapTicksToUs(pMap, &pMap->pPoints[iLow], tick);
+}
+
+uint32_t midiTempoMapUsToTick(const MIDI_TEMPO_MAP* pMap, uint64_t us) {
+  // Returns the last tick which starts at or before us, so that it reverses midiTempoMapTickToUs().
+  const MIDI_TEMPO_POINT* pPoint;
+  uint32_t iLow = 0, iHigh;
+  uint64_t ticks;
+
+  if (!pMap || pMap->numPoints == 0)
+    return 0;
+
+  iHigh = pMap->numPoints;
+  while (iHigh - iLow > 1) {
+    uint32_t iMid = (iLow + iHigh) / 2;
+    if (pMap->pPoints[iMid].us <= us)
+      iLow = iMid;
+    else
+      iHigh = iMid;
+  }
+
+  pPoint = &pMap->pPoints[iLow];
+  ticks = ((us - pPoint->us + 1) * pMap->PPQN - 1) / pPoint->usPerQuarter;
+  return ticks > UINT32_MAX - pPoint->tick ? UINT32_MAX : pPoint->tick + (uint32_t)ticks;
+}
+
+/*
+** midiBarMap* Functions
+*/
+static void _midiBarMapSetMeter(const MIDI_BAR_MAP* pMap, MIDI_BAR_POINT* pPoint, uint8_t nom, uint8_t denomPower) {
+  pPoint->nom = nom ? nom : 4;
+  pPoint->denom = (uint8_t)(1 << (denomPower & 0x07));
+  pPoint->ticksPerBeat = pMap->PPQN * 4 / pPoint->denom;
+  if (pPoint->ticksPerBeat == 0)
+    pPoint->ticksPerBeat = 1;
+}
+
+uint32_t midiBarMapBuild(MIDI_FILE* _pMFembedded, MIDI_BAR_MAP* pMap, MIDI_BAR_POINT* pPoints, uint32_t maxPoints) {
+  // Collects the time signatures of all tracks in one merged pass, like midiTempoMapBuild(). Until the first one, the
+  // song is in 4/4. Returns the number of points the song needs, the map is only complete if that's not more than
+  // maxPoints (0 finds out the size). Afterwards all tracks are at their start.
+  MIDI_INDEX_BUILD build;
+
+  memset(&build, 0, sizeof(build));
+  build.pBarMap = pMap;
+  build.pBarPoints = pPoints;
+  build.maxBarPoints = maxPoints;
+  if (!midiFileBuildIndex(_pMFembedded, &build))
+    return 0;
+
+  return build.numBarPoints;
+}
+
+bool midiBarMapTickToPos(const MIDI_BAR_MAP* pMap, uint32_t tick, MIDI_BAR_POS* pPos) {
+  const MIDI_BAR_POINT* pPoint;
+  uint32_t iLow = 0, iHigh, ticksPerBar, offset;
+
+  if (!pMap || !pPos || pMap->numPoints == 0)
+    return false;
+
+  // last point at or before tick
+  iHigh = pMap->numPoints;
+  while (iHigh - iLow > 1) {
+    uint32_t iMid = (iLow + iHigh) / 2;
+    if (pMap->pPoints[iMid].tick <= tick)
+      iLow = iMid;
+    else
+      iHigh = iMid;
+  }
+
+  pPoint = &pMap->pPoints[iLow];
+  ticksPerBar = pPoint->nom * pPoint->ticksPerBeat;
+  offset = tick - pPoint->tick;
+  pPos->bar = pPoint->bar + offset / ticksPerBar;
+  pPos->beat = offset % ticksPerBar / pPoint->ticksPerBeat;
+  pPos->tick = offset % ticksPerBar % pPoint->ticksPerBeat;
+  return true;
+}
+
+uint32_t midiBarMapPosToTick(const MIDI_BAR_MAP* pMap, const MIDI_BAR_POS* pPos) {
+  // Beats and ticks past the end of their bar or beat just count on.
+  const MIDI_BAR_POINT* pPoint;
+  uint32_t iLow = 0, iHigh;
+
+  if (!pMap || !pPos || pMap->numPoints == 0)
+    return 0;
+
+  // last point at or before the bar
+  iHigh = pMap->numPoints;
+  while (iHigh - iLow > 1) {
+    uint32_t iMid = (iLow + iHigh) / 2;
+    if (pMap->pPoints[iMid].bar <= pPos->bar)
+      iLow = iMid;
+    else
+      iHigh = iMid;
+  }
+
+  pPoint = &pMap->pPoints[iLow];
+  return pPoint->tick + ((pPos->bar - pPoint->bar) * pPoint->nom + pPos->beat) * pPoint->ticksPerBeat + pPos->tick;
+}
+
+/*
+** midiFileBuildIndex() Functions
+*/
+// State of midiFileBuildIndex() besides the results
+typedef struct {
+  // seek index: every track fills its own slice of pSeekPoints, the slices are closed up at the end
+  uint32_t seekOffset[MAX_MIDI_TRACKS];
+  uint32_t maxTrackPoints[MAX_MIDI_TRACKS];
+  uint32_t trackInterval[MAX_MIDI_TRACKS];
+  uint8_t msgStatus[MAX_MIDI_TRACKS];
+  MIDI_SEEK_POINT before[MAX_MIDI_TRACKS]; // state of each track before its next event, a checkpoint candidate
+  bool bSeek;
+  // chase index
+  uint32_t chaseInterval;
+  uint32_t lastSnapshotTick;
+  // maps
+  uint32_t lastTempoTick;
+  uint32_t lastSigTick;
+} _MIDI_INDEX_BUILDER;
+
+static bool _midiIndexInitSeek(_MIDI_FILE* pMF, _MIDI_INDEX_BUILDER* pBuilder, MIDI_INDEX_BUILD* pBuild) {
+  int32_t numTracks = midiReadGetNumTracks(pMF);
+  uint32_t interval = pBuild->seekInterval ? pBuild->seekInterval : pMF->Header.PPQN * 4u;
+  uint32_t totalSize = 0, offset = 0;
+
+  if (!pBuild->pSeekPoints)
+    return false;
+  if (interval == 0) // PPQN 0, a doubled 0 would thin out the points on every event
+    interval = 1;
+
+  for (int iTrack = 0; iTrack < numTracks; ++iTrack)
+    totalSize += pMF->Track[iTrack].sz;
+
+  for (int iTrack = 0; iTrack < numTracks; ++iTrack) {
+    MIDI_FILE_TRACK* pTrack = &pMF->Track[iTrack];
+
+    pTrack->pSeekPoints = NULL; // no room, the track is sought from its start
+    pTrack->numSeekPoints = 0;
+    pTrack->numEvents = 0;
+    pBuilder->maxTrackPoints[iTrack] = 0;
+    pBuilder->trackInterval[iTrack] = interval;
+    pBuilder->msgStatus[iTrack] = 0;
+    if (pBuild->maxSeekPoints < (uint32_t)numTracks)
+      continue;
+
+    // the rounded down shares never add up to more than maxSeekPoints
+    pBuilder->maxTrackPoints[iTrack] = 1;
+    if (totalSize)
+      pBuilder->maxTrackPoints[iTrack] += (uint32_t)((uint64_t)(pBuild->maxSeekPoints - numTracks) * pTrack->sz / totalSize);
+
+    pBuilder->seekOffset[iTrack] = offset;
+    pBuild->pSeekPoints[offset].tick = 0;
+    pBuild->pSeekPoints[offset].ptr = pTrack->pBaseNew + 8;
+    pBuild->pSeekPoints[offset].status = 0;
+    pBuild->pSeekPoints[offset].msgStatus = 0;
+    pTrack->numSeekPoints = 1;
+    offset += pBuilder->maxTrackPoints[iTrack];
+  }
+
+  return true;
+}
+
+static void _midiIndexAddSeekPoint(_MIDI_FILE* pMF, _MIDI_INDEX_BUILDER* pBuilder, MIDI_INDEX_BUILD* pBuild,
+    const MIDI_EVENT* pEvent, MIDI_SEEK_POINT* pPoint) {
+  // pPoint is where the track was before pEvent
+  MIDI_FILE_TRACK* pTrack = &pMF->Track[pEvent->track];
+  MIDI_SEEK_POINT* pPoints;
+  uint32_t* pInterval = &pBuilder->trackInterval[pEvent->track];
+
+  pTrack->numEvents++;
+  pPoint->msgStatus = pBuilder->msgStatus[pEvent->track];
+  pBuilder->msgStatus[pEvent->track] = pEvent->status;
+  if (pBuilder->maxTrackPoints[pEvent->track] < 2)
+    return;
+
+  // the ticks of a track only grow, so their distance to the last point can't wrap around like its tick plus interval
+  pPoints = &pBuild->pSeekPoints[pBuilder->seekOffset[pEvent->track]];
+  if (pPoint->tick - pPoints[pTrack->numSeekPoints - 1].tick < *pInterval)
+    return;
+
+  if (pTrack->numSeekPoints == pBuilder->maxTrackPoints[pEvent->track]) {
+    for (uint32_t i = 1; 2 * i < pTrack->numSeekPoints; ++i)
+      pPoints[i] = pPoints[2 * i];
+
+    pTrack->numSeekPoints = (pTrack->numSeekPoints + 1) / 2;
+    if (*pInterval <= UINT32_MAX / 2)
+      *pInterval *= 2;
+    if (pPoint->tick - pPoints[pTrack->numSeekPoints - 1].tick < *pInterval)
+      return;
+  }
+
+  pPoints[pTrack->numSeekPoints++] = *pPoint;
+}
+
+static void _midiIndexEndSeek(_MIDI_FILE* pMF, _MIDI_INDEX_BUILDER* pBuilder, MIDI_INDEX_BUILD* pBuild) {
+  // closes up the slices of the tracks, each moves down or stays
+  for (int iTrack = 0; iTrack < midiReadGetNumTracks(pMF); ++iTrack) {
+    MIDI_FILE_TRACK* pTrack = &pMF->Track[iTrack];
+
+    if (pTrack->numSeekPoints == 0)
+      continue;
+
+    memmove(&pBuild->pSeekPoints[pBuild->numSeekPoints], &pBuild->pSeekPoints[pBuilder->seekOffset[iTrack]],
+        pTrack->numSeekPoints * sizeof(MIDI_SEEK_POINT));
+    pTrack->pSeekPoints = &pBuild->pSeekPoints[pBuild->numSeekPoints];
+    pBuild->numSeekPoints += pTrack->numSeekPoints;
+  }
+}
+
+static void _midiIndexAddChaseEvent(_MIDI_INDEX_BUILDER* pBuilder, MIDI_INDEX_BUILD* pBuild, const MIDI_EVENT* pEvent) {
+  // the state is built in the slot behind the last snapshot. The events come in tick order, so their distance to it
+  // can't wrap around like its tick plus the interval.
+  MIDI_CHASE_SNAPSHOT* pSnapshots = pBuild->pChaseSnapshots;
+  uint32_t numSnapshots = pBuild->numChaseSnapshots;
+
+  if (pEvent->tick - pBuilder->lastSnapshotTick >= pBuilder->chaseInterval &&
+      numSnapshots + 1 == pBuild->maxChaseSnapshots) {
+    for (uint32_t i = 1; 2 * i < numSnapshots; ++i)
+      pSnapshots[i] = pSnapshots[2 * i];
+
+    pSnapshots[(numSnapshots + 1) / 2] = pSnapshots[numSnapshots];
+    numSnapshots = (numSnapshots + 1) / 2;
+    pBuilder->lastSnapshotTick = pSnapshots[numSnapshots - 1].tick;
+    if (pBuilder->chaseInterval <= UINT32_MAX / 2)
+      pBuilder->chaseInterval *= 2;
+  }
+
+  if (pEvent->tick - pBuilder->lastSnapshotTick >= pBuilder->chaseInterval) {
+    pSnapshots[numSnapshots].tick = pEvent->tick;
+    pSnapshots[numSnapshots + 1] = pSnapshots[numSnapshots];
+    pBuilder->lastSnapshotTick = pEvent->tick;
+    numSnapshots++;
+  }
+
+  if (pEvent->status >= msgControlChange && pEvent->status < msgSysEx1)
+    _midiChaseApply(&pSnapshots[numSnapshots], pEvent);
+
+  pBuild->numChaseSnapshots = numSnapshots;
+}
+
+static bool _midiIndexInitTempoMap(_MIDI_FILE* pMF, MIDI_INDEX_BUILD* pBuild) {
+  MIDI_TEMPO_MAP* pMap = pBuild->pTempoMap;
+
+  if (!pMap)
+    return false;
+
+  memset(pMap, 0, sizeof(MIDI_TEMPO_MAP));
+  pMap->pPoints = pBuild->pTempoPoints;
+  pMap->maxPoints = pBuild->maxTempoPoints;
+  pMap->PPQN = pMF->Header.PPQN;
+  if (pMap->PPQN == 0 || (pMap->PPQN & 0x8000)) // SMPTE time division has no tempo
+    return false;
+
+  if (pBuild->pTempoPoints && pMap->maxPoints > 0) {
+    pBuild->pTempoPoints[0].tick = 0;
+    pBuild->pTempoPoints[0].usPerQuarter = MIDI_US_PER_QUARTER_DEFAULT;
+    pBuild->pTempoPoints[0].us = 0;
+    pMap->numPoints = 1;
+  }
+
+  pBuild->numTempoPoints = 1;
+  return true;
+}
+
+static void _midiIndexAddTempoEvent(_MIDI_FILE* pMF, _MIDI_INDEX_BUILDER* pBuilder, MIDI_INDEX_BUILD* pBuild,
+    const MIDI_EVENT* pEvent) {
+  MIDI_TEMPO_MAP* pMap = pBuild->pTempoMap;
+  MIDI_TEMPO_POINT* pPoints = pBuild->pTempoPoints;
+  uint8_t mpqn[3];
+  uint32_t usPerQuarter;
+
+  pMap->lastTick = pEvent->tick;
+  if (pEvent->status != msgMetaEvent || pEvent->data1 != metaSetTempo || pEvent->payloadSize < 3 ||
+      midiReadEventPayload(pMF, pEvent, mpqn, 3) != 3)
+    return;
+
+  usPerQuarter = (mpqn[0] << 16) | (mpqn[1] << 8) | mpqn[2];
+  if (usPerQuarter == 0)
+    return;
+
+  if (pEvent->tick != pBuilder->lastTempoTick) { // changes at the same tick share a point, the last one wins
+    pBuilder->lastTempoTick = pEvent->tick;
+    pBuild->numTempoPoints++;
+  }
+  if (pBuild->numTempoPoints > pMap->numPoints + 1 || pMap->numPoints == 0)
+    return;
+
+  if (pBuild->numTempoPoints == pMap->numPoints) {
+    pPoints[pMap->numPoints - 1].usPerQuarter = usPerQuarter;
+  } else if (pMap->numPoints < pMap->maxPoints) {
+    const MIDI_TEMPO_POINT* pLast = &pPoints[pMap->numPoints - 1];
+
+    pPoints[pMap->numPoints].tick = pEvent->tick;
+    pPoints[pMap->numPoints].usPerQuarter = usPerQuarter;
+    pPoints[pMap->numPoints].us = _midiTempoMapTicksToUs(pMap, pLast, pEvent->tick);
+    pMap->numPoints++;
+  }
+}
+
+static bool _midiIndexInitBarMap(_MIDI_FILE* pMF, MIDI_INDEX_BUILD* pBuild) {
+  MIDI_BAR_MAP* pMap = pBuild->pBarMap;
+
+  if (!pMap)
+    return false;
+
+  memset(pMap, 0, sizeof(MIDI_BAR_MAP));
+  pMap->pPoints = pBuild->pBarPoints;
+  pMap->maxPoints = pBuild->maxBarPoints;
+  pMap->PPQN = pMF->Header.PPQN;
+  if (pMap->PPQN == 0 || (pMap->PPQN & 0x8000)) // SMPTE time division has no beats
+    return false;
+
+  if (pBuild->pBarPoints && pMap->maxPoints > 0) {
+    pBuild->pBarPoints[0].tick = 0;
+    pBuild->pBarPoints[0].bar = 0;
+    _midiBarMapSetMeter(pMap, &pBuild->pBarPoints[0], 4, 2);
+    pMap->numPoints = 1;
+  }
+
+  pBuild->numBarPoints = 1;
+  return true;
+}
+
+static void _midiIndexAddBarEvent(_MIDI_FILE* pMF, _MIDI_INDEX_BUILDER* pBuilder, MIDI_INDEX_BUILD* pBuild,
+    const MIDI_EVENT* pEvent) {
+  MIDI_BAR_MAP* pMap = pBuild->pBarMap;
+  MIDI_BAR_POINT* pPoints = pBuild->pBarPoints;
+  uint8_t timeSig[2];
+
+  if (pEvent->status != msgMetaEvent || pEvent->data1 != metaTimeSig || pEvent->payloadSize < 2 ||
+      midiReadEventPayload(pMF, pEvent, timeSig, 2) != 2)
+    return;
+
+  if (pEvent->tick != pBuilder->lastSigTick) { // changes at the same tick share a point, the last one wins
+    pBuilder->lastSigTick = pEvent->tick;
+    pBuild->numBarPoints++;
+  }
+  if (pBuild->numBarPoints > pMap->numPoints + 1 || pMap->numPoints == 0)
+    return;
+
+  if (pBuild->numBarPoints == pMap->numPoints) {
+    _midiBarMapSetMeter(pMap, &pPoints[pMap->numPoints - 1], timeSig[0], timeSig[1]);
+  } else if (pMap->numPoints < pMap->maxPoints) {
+    const MIDI_BAR_POINT* pLast = &pPoints[pMap->numPoints - 1];
+    uint32_t ticksPerBar = pLast->nom * pLast->ticksPerBeat;
+
+    pPoints[pMap->numPoints].tick = pEvent->tick;
+    pPoints[pMap->numPoints].bar = pLast->bar + (pEvent->tick - pLast->tick + ticksPerBar - 1) / ticksPerBar;
+    _midiBarMapSetMeter(pMap, &pPoints[pMap->numPoints], timeSig[0], timeSig[1]);
+    pMap->numPoints++;
+  }
+}
+
+static bool _midiIndexReadHead(_MIDI_FILE* pMF, _MIDI_INDEX_BUILDER* pBuilder, MIDI_MERGE* pMerge, int32_t iTrack) {
+  // Like midiReadGetNextMergedEvent() reads the next event of a track, but keeps where the track was before it
+  MIDI_FILE_TRACK* pTrack = &pMF->Track[iTrack];
+
+  pBuilder->before[iTrack].tick = pTrack->pos;
+  pBuilder->before[iTrack].ptr = pTrack->ptrNew;
+  pBuilder->before[iTrack].status = pTrack->last_status;
+  return midiReadGetNextEvent(pMF, iTrack, &pMerge->heads[iTrack]);
+}
+
+bool midiFileBuildIndex(MIDI_FILE* _pMFembedded, MIDI_INDEX_BUILD* pBuild) {
+  // Builds everything pBuild has memory for in one merged pass over all tracks, instead of one pass per
+  // midiFileBuildSeekIndex(), midiFileBuildChaseIndex(), midiTempoMapBuild() and midiBarMapBuild(), and returns their
+  // results in pBuild. Afterwards all tracks are at their start.
+  _MIDI_INDEX_BUILDER builder;
+  MIDI_MERGE merge;
+  MIDI_EVENT event;
+  bool bChase, bTempo, bBar;
+
+  _VAR_CAST;
+  if (!IsFilePtrValid(pMFembedded) || !pBuild)
+    return false;
+
+  pBuild->numSeekPoints = pBuild->numChaseSnapshots = pBuild->numTempoPoints = pBuild->numBarPoints = 0;
+  builder.bSeek = _midiIndexInitSeek(pMFembedded, &builder, pBuild);
+  bTempo = _midiIndexInitTempoMap(pMFembedded, pBuild);
+  bBar = _midiIndexInitBarMap(pMFembedded, pBuild);
+  bChase = pBuild->pChaseSnapshots && pBuild->maxChaseSnapshots >= 2;
+  if (bChase) {
+    pMFembedded->pChaseSnapshots = NULL;
+    pMFembedded->numChaseSnapshots = 0;
+    memset(&pBuild->pChaseSnapshots[0], MIDI_CHANNEL_UNSET, sizeof(MIDI_CHASE_SNAPSHOT));
+  }
+  builder.chaseInterval = pBuild->chaseInterval ? pBuild->chaseInterval : pMFembedded->Header.PPQN * 4u;
+  if (builder.chaseInterval == 0) // PPQN 0, one snapshot per tick at most, two on a tick would hold its events
+    builder.chaseInterval = 1;
+  builder.lastSnapshotTick = builder.lastTempoTick = builder.lastSigTick = 0;
+
+  merge.heapSize = 0;
+  for (int iTrack = 0; iTrack < midiReadGetNumTracks(pMFembedded); ++iTrack) {
+    _midiRewindTrack(&pMFembedded->Track[iTrack]);
+    if ((builder.bSeek || bChase || bTempo || bBar) && _midiIndexReadHead(pMFembedded, &builder, &merge, iTrack))
+      merge.heap[merge.heapSize++] = (uint8_t)iTrack;
+  }
+
+  for (int32_t iNode = merge.heapSize / 2 - 1; iNode >= 0; --iNode)
+    _midiMergeSiftDown(&merge, iNode);
+
+  while (merge.heapSize > 0) {
+    uint8_t iTrack = merge.heap[0];
+    MIDI_SEEK_POINT point = builder.before[iTrack];
+
+    event = merge.heads[iTrack];
+    if (!_midiIndexReadHead(pMFembedded, &builder, &merge, iTrack))
+      merge.heap[0] = merge.heap[--merge.heapSize];
+    _midiMergeSiftDown(&merge, 0);
+
+    pMFembedded->lastTick = event.tick;
+    if (builder.bSeek)
+      _midiIndexAddSeekPoint(pMFembedded, &builder, pBuild, &event, &point);
+    if (bChase)
+      _midiIndexAddChaseEvent(&builder, pBuild, &event);
+    if (bTempo)
+      _midiIndexAddTempoEvent(pMFembedded, &builder, pBuild, &event);
+    if (bBar)
+      _midiIndexAddBarEvent(pMFembedded, &builder, pBuild, &event);
+  }
+
+  for (int iTrack = 0; iTrack < midiReadGetNumTracks(pMFembedded); ++iTrack)
+    _midiRewindTrack(&pMFembedded->Track[iTrack]);
+
+  if (builder.bSeek)
+    _midiIndexEndSeek(pMFembedded, &builder, pBuild);
+  if (bTempo && pBuild->pTempoMap->numPoints == pBuild->numTempoPoints)
+    pMFembedded->duration = midiTempoMapTickToUs(pBuild->pTempoMap, pMFembedded->lastTick);
+  if (bChase) {
+    if (pBuild->numChaseSnapshots > 0)
+      pMFembedded->pChaseSnapshots = pBuild->pChaseSnapshots;
+    pMFembedded->numChaseSnapshots = pBuild->numChaseSnapshots;
+  }
+
+  return true;
+}
+
+/*
+** midiStream* Functions
+*/
+void midiStreamInit(MIDI_STREAM* pStream, OnStreamEventCallback_t pOnEventCb, OnPayloadChunkCallback_t pOnPayloadCb,
+    void* pUser) {
+  memset(pStream, 0, sizeof(MIDI_STREAM));
+  pStream->state = streamFileHeader;
+  pStream->pOnEventCb = pOnEventCb;
+  pStream->pOnPayloadCb = pOnPayloadCb;
+  pStream->pUser = pUser;
+}
+
+static void _midiStreamEndChunk(MIDI_STREAM* pStream) {
+  // An event cut off by the end of its track is dropped, like the readers stop at the end of the track chunk. The
+  // file header is skipped to its end as well, so a file without tracks is done right after it.
+  if (pStream->state != streamSkipChunk)
+    pStream->iTrack++;
+
+  pStream->numBytes = 0; // data bytes of a channel message cut off, the next chunk header starts at buf[0]
+  pStream->state = pStream->iTrack >= pStream->Header.iNumTracks ? streamDone : streamChunkHeader;
+}
+
+static void _midiStreamEndEvent(MIDI_STREAM* pStream) {
+  if (pStream->pOnEventCb)
+    pStream->pOnEventCb(&pStream->event, pStream->event.payloadSize ? pStream->payload : NULL, pStream->pUser);
+
+  pStream->state = streamDeltaTime;
+  pStream->value = 0;
+  pStream->numValueBytes = 0;
+}
+
+static bool _midiStreamAddVarLen(MIDI_STREAM* pStream, uint8_t byte) {
+  // Adds a byte to the variable-length value. Returns true when it's complete. Longer values than 4 bytes break the
+  // stream, like they end the track in the readers.
+  pStream->value = (pStream->value << 7) | (byte & 0x7f);
+  if (!(byte & 0x80))
+    return true;
+
+  if (++pStream->numValueBytes >= 4) {
+    hal_printfWarning("Warning, invalid variable-length value!\r\n");
+    pStream->state = streamError;
+  }
+
+  return false;
+}
+
+static void _midiStreamStartPayload(MIDI_STREAM* pStream) {
+  pStream->event.payloadPos = pStream->pos;
+  pStream->event.payloadSize = pStream->value;
+  pStream->payloadLeft = pStream->value;
+  pStream->bPayloadToCb = pStream->pOnPayloadCb != NULL;
+  pStream->runningStatus = 0; // meta events and sysex cancel the running status
+  if (pStream->payloadLeft == 0)
+    _midiStreamEndEvent(pStream);
+  else
+    pStream->state = streamPayload;
+}
+
+static void _midiStreamAddPayload(MIDI_STREAM* pStream, const uint8_t* pData, uint32_t num) {
+  uint32_t offset = pStream->event.payloadSize - pStream->payloadLeft;
+
+  if (offset < META_EVENT_MAX_DATA_SIZE)
+    memcpy(&pStream->payload[offset], pData, num < META_EVENT_MAX_DATA_SIZE - offset ? num : META_EVENT_MAX_DATA_SIZE - offset);
+
+  if (pStream->bPayloadToCb)
+    pStream->bPayloadToCb = pStream->pOnPayloadCb(pData, num, pStream->pUser);
+
+  pStream->payloadLeft -= num;
+  if (pStream->payloadLeft == 0)
+    _midiStreamEndEvent(pStream);
+}
+
+static void _midiStreamAddByte(MIDI_STREAM* pStream, uint8_t byte) {
+  // One byte of a track chunk, outside of payloads
+  switch (pStream->state) {
+    case streamDeltaTime:
+      if (!_midiStreamAddVarLen(pStream, byte))
+        break;
+
+      pStream->tick += pStream->value;
+      pStream->event.tick = pStream->tick;
+      pStream->event.track = (uint8_t)pStream->iTrack;
+      pStream->event.data1 = 0;
+      pStream->event.data2 = 0;
+      pStream->event.payloadPos = 0;
+      pStream->event.payloadSize = 0;
+      pStream->state = streamStatus;
+      break;
+
+    case streamStatus:
+      pStream->value = 0;
+      pStream->numValueBytes = 0;
+      pStream->numBytes = 0;
+      if (byte == msgMetaEvent || byte == msgSysEx1 || byte == msgSysEx2) {
+        pStream->event.status = byte;
+        pStream->state = byte == msgMetaEvent ? streamMetaType : streamLength;
+        break;
+      }
+
+      if (byte > msgSysEx1) {
+        hal_printfWarning("Warning, system common or realtime message in a track!\r\n");
+        pStream->state = streamError;
+        break;
+      }
+
+      if (byte & 0x80) {
+        pStream->event.status = byte;
+        pStream->state = streamData;
+        break;
+      }
+
+      if (!pStream->runningStatus) {
+        hal_printfWarning("Warning, data without a status to run on!\r\n");
+        pStream->state = streamError;
+        break;
+      }
+
+      pStream->event.status = pStream->runningStatus;
+      pStream->state = streamData;
+      // fall through - the byte is the first data byte
+
+    case streamData:
+      if (pStream->numBytes++ == 0)
+        pStream->event.data1 = byte;
+      else
+        pStream->event.data2 = byte;
+
+      if (pStream->numBytes == 2 || (pStream->event.status & 0xF0) == msgSetProgram ||
+          (pStream->event.status & 0xF0) == msgChangePressure) {
+        pStream->runningStatus = pStream->event.status;
+        _midiStreamEndEvent(pStream);
+      }
+      break;
+
+    case streamMetaType:
+      pStream->event.data1 = byte;
+      pStream->state = streamLength;
+      break;
+
+    case streamLength:
+      if (_midiStreamAddVarLen(pStream, byte))
+        _midiStreamStartPayload(pStream);
+      break;
+
+    default:
+      break;
+  }
+}
+
+bool midiStreamFeed(MIDI_STREAM* pStream, const void* pData, uint32_t size) {
+  // Takes the next size bytes of the file, in pieces of any size. Returns false, once the stream is broken.
+  const uint8_t* p = pData;
+  const uint8_t* pEnd = p + size;
+  uint32_t num;
+
+  if (!pStream || (!pData && size))
+    return false;
+
+  while (p < pEnd && pStream->state != streamError) {
+    switch (pStream->state) {
+      case streamFileHeader:
+      case streamHeaderData:
+      case streamChunkHeader:
+        pStream->buf[pStream->numBytes++] = *p++;
+        pStream->pos++;
+        if (pStream->state == streamHeaderData) {
+          pStream->chunkLeft--;
+          if (pStream->numBytes < 6)
+            break;
+
+          pStream->Header.iVersion = (pStream->buf[0] << 8) | pStream->buf[1];
+          pStream->Header.iNumTracks = (pStream->buf[2] << 8) | pStream->buf[3];
+          pStream->Header.PPQN = (pStream->buf[4] << 8) | pStream->buf[5];
+          pStream->numBytes = 0;
+          pStream->state = streamSkipChunk; // rest of a longer header
+          if (pStream->chunkLeft == 0)
+            _midiStreamEndChunk(pStream);
+          break;
+        }
+
+        if (pStream->numBytes < 8)
+          break;
+
+        pStream->numBytes = 0;
+        pStream->chunkLeft = (pStream->buf[4] << 24) | (pStream->buf[5] << 16) | (pStream->buf[6] << 8) | pStream->buf[7];
+        if (pStream->state == streamFileHeader) {
+          if (memcmp(pStream->buf, "MThd", 4) != 0 || pStream->chunkLeft < 6) {
+            pStream->state = streamError;
+            break;
+          }
+
+          pStream->Header.iHeaderSize = pStream->chunkLeft;
+          pStream->state = streamHeaderData;
+        }
+        else if (memcmp(pStream->buf, "MTrk", 4) == 0) {
+          pStream->tick = 0;
+          pStream->runningStatus = 0;
+          pStream->value = 0;
+          pStream->numValueBytes = 0;
+          pStream->state = streamDeltaTime;
+          if (pStream->chunkLeft == 0)
+            _midiStreamEndChunk(pStream);
+        }
+        else { // unknown chunks are skipped, as the standard says
+          pStream->state = streamSkipChunk;
+          if (pStream->chunkLeft == 0)
+            _midiStreamEndChunk(pStream);
+        }
+        break;
+
+      case streamSkipChunk:
+      case streamPayload:
+        num = (uint32_t)(pEnd - p) < pStream->chunkLeft ? (uint32_t)(pEnd - p) : pStream->chunkLeft;
+        if (pStream->state == streamPayload) {
+          if (num > pStream->payloadLeft)
+            num = pStream->payloadLeft;
+
+          _midiStreamAddPayload(pStream, p, num);
+        }
+
+        p += num;
+        pStream->pos += num;
+        pStream->chunkLeft -= num;
+        if (pStream->chunkLeft == 0)
+          _midiStreamEndChunk(pStream);
+        break;
+
+      case streamDone:
+        pStream->pos += pEnd - p;
+        p = pEnd;
+        break;
+
+      default:
+        pStream->pos++;
+        pStream->chunkLeft--;
+        _midiStreamAddByte(pStream, *p++);
+        if (pStream->chunkLeft == 0 && pStream->state != streamError)
+          _midiStreamEndChunk(pStream);
+        break;
+    }
+  }
+
+  return pStream->state != streamError;
+}
+
 // TODO: 'open for write' implementation!
 bool	midiFileClose(MIDI_FILE* _pMFembedded) {
   _VAR_CAST;
   if (!IsFilePtrValid(pMFembedded))			return false;
+  if (!pMFembedded->source.pFuncs)			return false; // closed already, the pool may have given it to another file
 
   // TODO: open for writing implementation here!
-  if (pMFembedded->pFile)
-    return hal_fclose(pMFembedded->pFile);
+#ifdef MIDI_READ_AHEAD
+  _midiCacheWaitForReadAhead(pMFembedded);
+#endif
+  if (pMFembedded->source.pFuncs->close)
+    pMFembedded->source.pFuncs->close(&pMFembedded->source);
+
+  memset(&pMFembedded->source, 0, sizeof(MIDI_SOURCE));
+  pMFembedded->pMapped = NULL;
+  pMFembedded->mappedSize = 0;
+
+  if (pMFembedded >= g_midiFilePool && pMFembedded < &g_midiFilePool[MAX_MIDI_FILES])
+    POOL_RELEASE(&g_midiFilePoolInUse[pMFembedded - g_midiFilePool]);
 
   return true;
 }
@@ -36,17 +36,68 @@
 **						not explicitly stored)
 **		midiSong*   For operations that work across the song, i.e. SetTempo
 **		midiTrack*  For operations on a specific track, i.e. AddNoteOn
+**		midiSource* For the byte sources a file can be read from, i.e. InitMemory
+**		midiTimeline* For whole songs decoded into memory, i.e. Init
+**		midiFilter* For the events a reader is interested in, i.e. SetMeta
+**		midiStream* For files which arrive in pieces, without seeking, i.e. Feed
+**		midiTempoMap* For converting between ticks and time, i.e. TickToUs
+**		midiBarMap* For converting between ticks and bars and beats, i.e. TickToPos
 */
 
 /*
 ** Types because we're dealing with files, and need to be careful
 */
 
+// The settings below can be changed from the build, e.g. with -DMAX_MIDI_FILES=4 or -DMIDI_READ_AHEAD.
+
 // Cache
-#define PLAYBACK_CACHE_SIZE 10 * 1024 // 10KB cache
+#ifndef PLAYBACK_CACHE_SIZE
+#define PLAYBACK_CACHE_SIZE (10 * 1024) // 10KB built in cache. midiFileSetCacheBlocks() can use an own buffer of any size instead.
+#endif
+#ifndef TRACK_CACHE_MIN_SIZE
+#define TRACK_CACHE_MIN_SIZE 64 // Smallest window a track gets in cacheModePerTrack. Tracks beyond the budget share one window.
+#endif
+//#define MIDI_CACHE_WARM_UP // midiFileOpen() switches MIDI 1 files to cacheModePerTrack and hands the track heads it read with the chunk headers to the track windows
+#ifndef MAX_CACHE_BLOCKS
+#define MAX_CACHE_BLOCKS 32 // [default: 32] - Maximum number of blocks in cacheModeBlocks. Each block needs 16 Bytes of RAM.
+#endif
+//#define MIDI_READ_AHEAD // Refill a second buffer of each cache window in the background (see hal_runAsync()). Doubles the cache RAM.
+//#define MIDI_PARALLEL // midiReadTimelineParallel() decodes the tracks of files in memory on several cores (see hal_runParallel())
+
+// Index
+//#define MIDI_INDEX_FAST_KEY // midiFileSaveIndex() keys the index on a hash of the chunk headers instead of the whole file, so midiFileLoadIndex() only reads a few bytes, but doesn't notice events changed in place.
+
+typedef enum {
+  cacheModeSingle,   // one window for the whole file (best for MIDI 0 files)
+  cacheModePerTrack, // one window per track, refilled within the track chunk (best for MIDI 1 files)
+  cacheModeBlocks,   // file aligned blocks with LRU replacement (best for big MIDI 1 files with far apart tracks)
+} tMIDI_CACHE_MODE;
+
+// hits and misses count the reads of the cache in the same way in every cache mode: one per read or peek a reader
+// asks for, no matter how many bytes, windows or blocks it covers.
+typedef struct {
+  uint32_t hits;          // reads served by the cache, a read ahead swapped in included
+  uint32_t misses;        // reads which had to fetch from the source, once or more
+  uint32_t fetches;       // reads from the source, the uncached ones at open and for the index key included
+  uint32_t bytesFetched;  // bytes read from the source, including read ahead
+  uint32_t refillTime;    // time spent fetching inside of reads, in hal_clock() units
+} MIDI_CACHE_STATS;
+
+typedef void(*OnCacheMissCallback_t)(uint32_t reqStartPos, uint32_t reqNumBytes, uint32_t cachePosOnReq, uint32_t cacheSize);
+
+typedef enum {
+  aheadIdle,
+  aheadPending,      // background job is reading
+  aheadReady,        // second buffer can be swapped in
+} tMIDI_READ_AHEAD_STATE;
 
 // Embedded Constants
+#ifndef META_EVENT_MAX_DATA_SIZE
 #define META_EVENT_MAX_DATA_SIZE 128 // The meta event size must be at least 5 bytes long, to store: variable 4 byte length, 1 byte event id.
+#endif
+#ifndef PAYLOAD_CHUNK_SIZE
+#define PAYLOAD_CHUNK_SIZE 64 // Most bytes per callback of midiReadStreamPayload() on files which aren't in memory. Taken from the stack.
+#endif
 
 /*
 ** MIDI Constants
@@ -61,7 +112,15 @@
 
 // This parameter should be set as small as possible. Each track will need 60 Bytes of memory.
 // Using 32 Tracks will need about 1KB of RAM.
+#ifndef MAX_MIDI_TRACKS
 #define MAX_MIDI_TRACKS			32  // [default: 32] - Maximum supported tracks. Can be set to 1 on MIDI type 0 tracks, should be at least 1 on MIDI type 1 files.
+#endif
+
+// Files opened by midiFileOpen(), midiFileOpenMemory() and midiFileOpenSource() come from a static pool. Each of them
+// needs sizeof(MIDI_FILE_CONTEXT) Bytes of RAM, most of it for the cache. midiFileOpenSourceInto() doesn't use the pool.
+#ifndef MAX_MIDI_FILES
+#define MAX_MIDI_FILES			1   // [default: 1] - Maximum number of files open at once from the pool.
+#endif
 
 // Don't change this!
 #define MICROSECONDS_PER_MINUTE 60000000L
@@ -81,6 +140,77 @@ typedef struct {
   int32_t	iEndPos;
 } MIDI_END_POINT;
 
+/*
+** Byte sources
+** A source hands out the bytes of a MIDI file by absolute position. Sources which have the whole file in memory
+** (memory buffers, mapped files) implement data(), so they are read without any copy into the cache.
+*/
+typedef struct _MIDI_SOURCE MIDI_SOURCE;
+
+typedef struct {
+  size_t (*read)(MIDI_SOURCE* pSource, void* dst, uint32_t startPos, size_t num); // returns the number of bytes read
+  uint32_t (*size)(MIDI_SOURCE* pSource);         // returns 0, if the size is unknown
+  const uint8_t* (*data)(MIDI_SOURCE* pSource);   // optional, returns the whole file or NULL
+  void (*close)(MIDI_SOURCE* pSource);            // optional
+  bool bConcurrentReads;                          // read() may run on several threads at once (no shared position)
+} MIDI_SOURCE_FUNCS;
+
+struct _MIDI_SOURCE {
+  const MIDI_SOURCE_FUNCS* pFuncs;
+  void* pHandle;        // FILE*, FIL*, ... the source reads from
+  const uint8_t* pData; // memory and mapped sources
+  uint32_t size;
+};
+
+typedef struct {
+  uint8_t* pData;
+  uint32_t size;      // capacity of the window
+  uint32_t startPos;  // file position of pData[0]
+  uint32_t numBytes;  // valid bytes in the window, 0 if empty
+#ifdef MIDI_READ_AHEAD
+  uint8_t* pAhead;    // second buffer, filled in the background and swapped with pData on a miss
+  uint32_t aheadStartPos;
+  uint32_t aheadSize;
+  volatile uint32_t aheadNumBytes;
+  volatile uint8_t aheadState; // tMIDI_READ_AHEAD_STATE, written by the background job once pending
+  MIDI_SOURCE* pAheadSource;
+#endif
+} MIDI_CACHE_WINDOW;
+
+typedef struct {
+  uint8_t* pData;
+  uint32_t startPos;  // file position of pData[0], a multiple of the block size
+  uint32_t numBytes;  // valid bytes in the block, 0 if unused
+  uint32_t lastUse;   // for LRU replacement
+} MIDI_CACHE_BLOCK;
+
+// Checkpoint of the seek index (see midiFileBuildSeekIndex()): where a track can be read on from without going back
+// to its start. 12 Bytes of RAM each.
+typedef struct {
+  uint32_t tick;   // track position at this point, the tick of the event before
+  uint32_t ptr;    // file position of the next event
+  uint8_t status;  // running status at this point, 0 if there is none
+  uint8_t msgStatus; // last status byte, meta events and sysex included, as midiReadGetNextMessage() keeps it
+} MIDI_SEEK_POINT;
+
+// Controller state of a channel, to resend after a seek (see midiReadChase()). Values which weren't set yet are
+// MIDI_CHANNEL_UNSET (MIDI_CHANNEL_UNSET_PITCH for pitchWheel).
+#define MIDI_CHANNEL_UNSET	0xFF
+#define MIDI_CHANNEL_UNSET_PITCH	0xFFFF
+typedef struct {
+  uint8_t program;
+  uint8_t pressure;        // channel pressure
+  uint16_t pitchWheel;     // 0 - 16383, MIDI_WHEEL_CENTRE is the centre
+  uint8_t controller[128];
+} MIDI_CHANNEL_STATE;
+
+// State of all channels at a tick: every control change, program change, channel pressure and pitch wheel event
+// before it has been applied. 2116 Bytes of RAM each.
+typedef struct {
+  uint32_t tick;
+  MIDI_CHANNEL_STATE channel[16];
+} MIDI_CHASE_SNAPSHOT;
+
 typedef struct 	{
   uint32_t ptrNew;
   uint32_t pBaseNew;
@@ -90,10 +220,14 @@ typedef struct 	{
   int32_t deltaTime; // relative offset, when this event occurs. May be negative, if current event is delayed
   /* For Reading MIDI Files */
   uint32_t sz;						/* size of whole iTrack */
+  MIDI_CACHE_WINDOW cache;  /* used in cacheModePerTrack only */
   /* For Writing MIDI Files */
   uint32_t iBlockSize;				/* max size of track */
   uint8_t iDefaultChannel;		/* use for write only */
   uint8_t last_status;				/* used for running status */
+  const MIDI_SEEK_POINT* pSeekPoints;	/* seek index of the track, ascending by tick */
+  uint32_t numSeekPoints;
+  uint32_t numEvents;  /* counted with the seek index, see midiReadGetNumEvents() */
 
   uint32_t debugLastClock;
   uint32_t debugLastMsgDt;
@@ -108,21 +242,65 @@ typedef struct 	{
   uint16_t	PPQN;			/* pulses per quarter note */
 } MIDI_HEADER;
 
+// Events midiReadGetNextMessage() returns (see midiFileSetFilter()). All others are skipped by their length without
+// being decoded or copied. Their delta times are added to the next returned message.
+#define MIDI_FILTER_MSG(status)	(1u << (((status) >> 4) & 0x07)) // bit of a channel message type in msgMask
+#define MIDI_FILTER_SYSEX	MIDI_FILTER_MSG(msgSysEx1)
+typedef struct {
+  uint8_t msgMask;      // MIDI_FILTER_MSG() of the wanted channel messages, and MIDI_FILTER_SYSEX
+  uint8_t metaMask[16]; // bit (type & 7) of byte (type >> 3) for each wanted tMIDI_META type
+} MIDI_FILTER;
+
 typedef struct {
-  FILE				*pFile;
+  MIDI_SOURCE source;
+  const uint8_t *pMapped; // whole file, if the source has it in memory (see MIDI_SOURCE_FUNCS::data), otherwise NULL
+  uint32_t mappedSize;
   bool				bOpenForWriting;
 
   MIDI_HEADER			Header;
   uint32_t file_sz;
   int32_t usPerTick; // microseconds per tick
+  tMIDI_CACHE_MODE cacheMode;
+  MIDI_CACHE_BLOCK cacheBlocks[MAX_CACHE_BLOCKS]; // used in cacheModeBlocks only
+  uint32_t numCacheBlocks;
+  uint32_t cacheBlockSize;
+  uint32_t cacheUseCounter;
+  MIDI_CACHE_STATS cacheStats; // stays zero for files in memory, which don't need the cache
+  OnCacheMissCallback_t pOnCacheMissCb;
+  MIDI_FILTER filter;
+  bool bFilter; // false: midiReadGetNextMessage() returns every event
+  MIDI_CHASE_SNAPSHOT* pChaseSnapshots; // see midiFileBuildChaseIndex(), ascending by tick
+  uint32_t numChaseSnapshots;
+  uint32_t lastTick; // see midiReadGetLastTick()
+  uint64_t duration; // see midiReadGetDuration()
 
   MIDI_FILE_TRACK		Track[MAX_MIDI_TRACKS];
+
+  // cache memory, last so opening a file doesn't need to clear it
+  MIDI_CACHE_WINDOW cacheWindow; // cacheModeSingle
+  uint8_t cache[PLAYBACK_CACHE_SIZE]; // windows and default memory of the blocks
+#ifdef MIDI_READ_AHEAD
+  uint8_t cacheAhead[PLAYBACK_CACHE_SIZE]; // second buffers of the windows, same layout as cache
+#endif
 } _MIDI_FILE;
 
+typedef _MIDI_FILE MIDI_FILE_CONTEXT; // storage of a file for midiFileOpenSourceInto()
+
 /*
 ** MIDI structures, accessibly externably
 */
 typedef	void 	MIDI_FILE;
+
+// Where the data of a meta event or sysex is in the file. Nothing is copied until it's asked for with
+// midiReadCopyPayload() or midiReadStreamPayload().
+typedef struct {
+  uint32_t pos;   // file position of the data behind the length
+  uint32_t size;  // number of data bytes, 0 for channel messages
+  int32_t iTrack; // the payload is read through the cache of this track
+} MIDI_PAYLOAD;
+
+typedef bool(*OnPayloadChunkCallback_t)(const uint8_t* pChunk, uint32_t size, void* pUser); // return false to stop
+
 typedef struct {
           tMIDI_MSG	iType;
 
@@ -136,6 +314,7 @@ typedef struct {
           /* Raw data chunk */
           uint8_t dataEmbedded[META_EVENT_MAX_DATA_SIZE + 1]; // constant data block (+ 1 byte for nullterminator on text events)
           uint32_t data_sz_embedded; // This is the real size of meta text data!
+          MIDI_PAYLOAD payload; // meta events and sysex: all of their data, dataEmbedded holds only the first bytes of it
 
           union {
             struct {
@@ -210,14 +389,176 @@ typedef struct {
   
         } MIDI_MSG;
 
+// Compact alternative to MIDI_MSG for bulk reading (see midiReadGetNextEvent()). Payloads of meta events and sysex
+// aren't copied, only their position in the file is kept (see midiReadEventPayload()).
+typedef struct {
+  uint32_t tick;        // absolute position in ticks
+  uint8_t status;       // status byte including the channel, msgSysEx1 / msgSysEx2 for sysex, msgMetaEvent for meta events
+  uint8_t data1;        // first data byte, the tMIDI_META type for meta events
+  uint8_t data2;        // second data byte, 0 if the message has only one
+  uint8_t track;        // index of the track the event belongs to
+  uint32_t payloadPos;  // meta events and sysex: file position of the data behind the length
+  uint32_t payloadSize; // meta events and sysex: number of data bytes, 0 for channel messages
+} MIDI_EVENT;
+
+// State of midiReadGetNextMergedEvent(): the next event of every track, kept in a min-heap ordered by tick.
+typedef struct {
+  MIDI_EVENT heads[MAX_MIDI_TRACKS];
+  uint8_t heap[MAX_MIDI_TRACKS]; // track indices, heap[0] is the track of the next event
+  int32_t heapSize;
+} MIDI_MERGE;
+
+// All tracks of a song decoded into one tick-sorted timeline (see midiReadTimeline()). Each array holds one entry per
+// event. Payloads of meta events and sysex are copied into pArena. The memory belongs to the caller and is handed
+// over with midiTimelineInit().
+#define MIDI_TIMELINE_BYTES_PER_EVENT	16
+
+typedef struct {
+  uint32_t* pTick;
+  uint32_t* pPayloadOffset; // into pArena, meta events and sysex only
+  uint32_t* pPayloadSize;
+  uint8_t* pStatus;
+  uint8_t* pData1;
+  uint8_t* pData2;
+  uint8_t* pTrack;
+  uint32_t numEvents;
+  uint32_t maxEvents;
+
+  uint8_t* pArena;
+  uint32_t arenaSize;
+  uint32_t maxArenaSize;
+} MIDI_TIMELINE;
+
+// All tempo changes of a song, to convert between ticks and microseconds in O(log n) (see midiTempoMapBuild()).
+typedef struct {
+  uint32_t tick;
+  uint32_t usPerQuarter; // tempo from this tick on, as stored in the file
+  uint64_t us;           // time of tick from the start of the song
+} MIDI_TEMPO_POINT;
+
+typedef struct {
+  const MIDI_TEMPO_POINT* pPoints; // ascending by tick, pPoints[0] is at tick 0. The memory belongs to the caller.
+  uint32_t numPoints;
+  uint32_t maxPoints;
+  uint16_t PPQN;
+  uint32_t lastTick;         // tick of the last event of all tracks, the end of the song
+} MIDI_TEMPO_MAP;
+
+// All time signature changes of a song, to convert between ticks and bar/beat positions in O(log n) (see
+// midiBarMapBuild()). A time signature starts a new bar, even if the one before isn't complete.
+typedef struct {
+  uint32_t tick;         // start of the segment, on a bar line
+  uint32_t bar;          // number of bars before tick
+  uint8_t nom;           // beats per bar
+  uint8_t denom;         // note value of a beat, i.e. 4 for quarter notes
+  uint32_t ticksPerBeat;
+} MIDI_BAR_POINT;
+
+typedef struct {
+  const MIDI_BAR_POINT* pPoints; // ascending by tick, pPoints[0] is at tick 0. The memory belongs to the caller.
+  uint32_t numPoints;
+  uint32_t maxPoints;
+  uint16_t PPQN;
+} MIDI_BAR_MAP;
+
+// Position in bars, counted from 0 like the rest
+typedef struct {
+  uint32_t bar;
+  uint32_t beat; // within the bar
+  uint32_t tick; // within the beat
+} MIDI_BAR_POS;
+
+// Memory and results of midiFileBuildIndex(), which builds the seek index, the chase index and the maps in one pass
+// instead of four. Parts without memory (pSeekPoints, pChaseSnapshots, pTempoMap or pBarMap NULL) aren't built, and
+// the tracks keep their seek index or chase index. The results are what the single builders would return.
+typedef struct {
+  MIDI_SEEK_POINT* pSeekPoints;         // see midiFileBuildSeekIndex()
+  uint32_t maxSeekPoints;
+  uint32_t seekInterval;
+  MIDI_CHASE_SNAPSHOT* pChaseSnapshots; // see midiFileBuildChaseIndex()
+  uint32_t maxChaseSnapshots;
+  uint32_t chaseInterval;
+  MIDI_TEMPO_MAP* pTempoMap;            // see midiTempoMapBuild(), pTempoPoints may be NULL to find out the size
+  MIDI_TEMPO_POINT* pTempoPoints;
+  uint32_t maxTempoPoints;
+  MIDI_BAR_MAP* pBarMap;                // see midiBarMapBuild(), pBarPoints may be NULL to find out the size
+  MIDI_BAR_POINT* pBarPoints;
+  uint32_t maxBarPoints;
+
+  uint32_t numSeekPoints;      // used
+  uint32_t numChaseSnapshots;  // used
+  uint32_t numTempoPoints;     // needed
+  uint32_t numBarPoints;       // needed
+} MIDI_INDEX_BUILD;
+
+// Layout version of the index midiFileSaveIndex() writes. Indexes of other versions aren't loaded.
+#define MIDI_INDEX_VERSION	3
+
+// Push parser for files which can't be read at random positions, like a pipe or a download in progress. Any pieces of
+// the file are handed to midiStreamFeed(), which calls back with every event as soon as it is complete. The tracks
+// come one after another, as they are stored. Memory stays the same, however long the file or its payloads are.
+typedef enum {
+  streamFileHeader,  // collecting the MThd chunk header
+  streamHeaderData,  // collecting format, number of tracks and PPQN
+  streamChunkHeader, // collecting id and size of the next chunk
+  streamSkipChunk,   // rest of the header, or a chunk which isn't a track
+  streamDeltaTime,
+  streamStatus,
+  streamMetaType,
+  streamLength,      // length of a meta event or sysex
+  streamData,        // data bytes of a channel message
+  streamPayload,     // data of a meta event or sysex
+  streamDone,        // all tracks of the header are complete, the rest is ignored
+  streamError,       // not a MIDI file, or a broken variable-length value or running status
+} tMIDI_STREAM_STATE;
+
+// pPayload holds the first bytes of the payload of meta events and sysex (all of it, if it's not larger than
+// META_EVENT_MAX_DATA_SIZE), otherwise NULL. payloadPos of the event is the position in the stream.
+typedef void(*OnStreamEventCallback_t)(const MIDI_EVENT* pEvent, const uint8_t* pPayload, void* pUser);
+
+typedef struct {
+  tMIDI_STREAM_STATE state;
+  MIDI_HEADER Header;         // valid from streamChunkHeader on
+  uint32_t pos;               // position of the next byte in the stream
+  uint32_t iTrack;            // index of the track being read
+  uint32_t chunkLeft;         // bytes left in the current chunk
+  uint32_t value;             // variable-length value being collected
+  uint8_t numValueBytes;
+  uint8_t numBytes;           // bytes collected in buf, or data bytes of a channel message
+  uint8_t buf[8];
+  uint8_t runningStatus;
+  uint32_t tick;              // of the current track
+  uint32_t payloadLeft;
+  bool bPayloadToCb;          // pOnPayloadCb still wants the rest of the current payload
+  MIDI_EVENT event;           // being collected
+  uint8_t payload[META_EVENT_MAX_DATA_SIZE];
+
+  OnStreamEventCallback_t pOnEventCb;
+  OnPayloadChunkCallback_t pOnPayloadCb; // optional: all payload bytes as they arrive, before the event callback
+  void* pUser;
+} MIDI_STREAM;
+
 /*
 ** midiFile* Prototypes
 */
-int32_t readChunkFromFile(FILE* pFile, void* dst, int32_t startPos, size_t num);
-int32_t readByteFromFile(FILE* pFile, uint8_t* dst, int32_t startPos);
-int32_t readWordFromFile(FILE* pFile, uint16_t* dst, int32_t startPos);
-int32_t readDwordFromFile(FILE* pFile, uint32_t* dst, int32_t startPos);
+int32_t readChunkFromFile(_MIDI_FILE* pMF, void* dst, int32_t startPos, size_t num);
+int32_t readByteFromFile(_MIDI_FILE* pMF, uint8_t* dst, int32_t startPos);
+int32_t readWordFromFile(_MIDI_FILE* pMF, uint16_t* dst, int32_t startPos);
+int32_t readDwordFromFile(_MIDI_FILE* pMF, uint32_t* dst, int32_t startPos);
 void setPlaybackTempo(_MIDI_FILE* pMidiFile, int32_t bpm);
+bool midiFileSetCacheMode(MIDI_FILE* _pMFembedded, tMIDI_CACHE_MODE mode, uint32_t budget);
+bool midiFileSetCacheBlocks(MIDI_FILE* _pMFembedded, uint8_t* pBuffer, uint32_t blockSize, uint32_t numBlocks);
+bool midiFileSetCacheMissCallback(MIDI_FILE* _pMFembedded, OnCacheMissCallback_t pOnCacheMissCb);
+bool midiFileGetCacheStats(const MIDI_FILE* _pMFembedded, MIDI_CACHE_STATS* pStats);
+bool midiFileResetCacheStats(MIDI_FILE* _pMFembedded);
+bool midiFileSetFilter(MIDI_FILE* _pMFembedded, const MIDI_FILTER* pFilter);
+// The builders (midiFileBuild*(), midiTempoMapBuild() and midiBarMapBuild()) read all tracks from their start and
+// leave them there, so they break any reading in progress. Build before reading or playing, or seek afterwards.
+bool midiFileBuildIndex(MIDI_FILE* _pMFembedded, MIDI_INDEX_BUILD* pBuild);
+uint32_t midiFileBuildSeekIndex(MIDI_FILE* _pMFembedded, MIDI_SEEK_POINT* pPoints, uint32_t maxPoints, uint32_t interval);
+uint32_t midiFileBuildChaseIndex(MIDI_FILE* _pMFembedded, MIDI_CHASE_SNAPSHOT* pSnapshots, uint32_t maxSnapshots, uint32_t interval);
+uint32_t midiFileSaveIndex(const MIDI_FILE* _pMFembedded, const MIDI_TEMPO_MAP* pTempoMap, const MIDI_BAR_MAP* pBarMap, void* pBuffer, uint32_t bufferSize);
+bool midiFileLoadIndex(MIDI_FILE* _pMFembedded, const void* pIndex, uint32_t size, MIDI_TEMPO_MAP* pTempoMap, MIDI_BAR_MAP* pBarMap);
 
 MIDI_FILE  *midiFileCreate(const char *pFilename, bool bOverwriteIfExists);
 int32_t			midiFileSetTracksDefaultChannel(MIDI_FILE* _pMFembedded, int32_t iTrack, int32_t iChannel);
@@ -229,8 +570,17 @@ int32_t			midiFileGetPPQN(MIDI_FILE* _pMFembedded);
 int32_t			midiFileSetVersion(MIDI_FILE* _pMFembedded, int32_t iVersion);
 int32_t			midiFileGetVersion(MIDI_FILE* _pMFembedded);
 MIDI_FILE  *midiFileOpen(const char *pFilename);
+MIDI_FILE  *midiFileOpenMemory(const void *pData, uint32_t size);
+MIDI_FILE  *midiFileOpenSource(const MIDI_SOURCE *pSource);
+MIDI_FILE  *midiFileOpenSourceInto(MIDI_FILE_CONTEXT *pContext, const MIDI_SOURCE *pSource);
 bool		midiFileClose(MIDI_FILE* _pMFembedded);
 
+/*
+** midiSource* Prototypes
+*/
+bool		midiSourceInitFile(MIDI_SOURCE* pSource, const char *pFilename);
+void		midiSourceInitMemory(MIDI_SOURCE* pSource, const void *pData, uint32_t size);
+
 /*
 ** midiSong* Prototypes
 */
@@ -262,8 +612,56 @@ bool		midiTrackGetEndPos(MIDI_FILE* _pMFembedded, int32_t iTrack);
 ** midiRead* Prototypes
 */
 int32_t midiReadGetNumTracks(const MIDI_FILE* _pMFembedded);
+uint32_t midiReadGetNumEvents(const MIDI_FILE* _pMFembedded, int32_t iTrack);
+uint32_t midiReadGetLastTick(const MIDI_FILE* _pMFembedded);
+uint64_t midiReadGetDuration(const MIDI_FILE* _pMFembedded);
 bool		midiReadGetNextMessage(const MIDI_FILE* _pMFembedded, int32_t iTrack, MIDI_MSG* pMsgEmbedded);
+bool midiReadGetNextFilteredMessage(const MIDI_FILE* _pMFembedded, int32_t iTrack, MIDI_MSG* pMsgEmbedded, const MIDI_FILTER* pFilter);
 void midiReadInitMessage(MIDI_MSG *pMsg);
+bool midiReadGetNextEvent(const MIDI_FILE* _pMFembedded, int32_t iTrack, MIDI_EVENT* pEvent);
+bool midiReadSeek(const MIDI_FILE* _pMFembedded, int32_t iTrack, uint32_t tick, MIDI_MSG* pMsgEmbedded);
+bool midiReadChase(const MIDI_FILE* _pMFembedded, uint32_t tick, MIDI_CHASE_SNAPSHOT* pState);
+uint32_t midiReadEventPayload(const MIDI_FILE* _pMFembedded, const MIDI_EVENT* pEvent, void* dst, uint32_t maxSize);
+uint32_t midiReadCopyPayload(const MIDI_FILE* _pMFembedded, const MIDI_PAYLOAD* pPayload, uint32_t offset, void* dst, uint32_t maxSize);
+const uint8_t* midiReadGetPayloadData(const MIDI_FILE* _pMFembedded, const MIDI_PAYLOAD* pPayload);
+bool midiReadStreamPayload(const MIDI_FILE* _pMFembedded, const MIDI_PAYLOAD* pPayload, OnPayloadChunkCallback_t pOnChunkCb, void* pUser);
+bool midiReadInitMerge(const MIDI_FILE* _pMFembedded, MIDI_MERGE* pMerge);
+bool midiReadGetNextMergedEvent(const MIDI_FILE* _pMFembedded, MIDI_MERGE* pMerge, MIDI_EVENT* pEvent);
+bool midiReadTimeline(MIDI_FILE* _pMFembedded, MIDI_TIMELINE* pTimeline);
+bool midiReadTimelineParallel(MIDI_FILE* _pMFembedded, MIDI_TIMELINE* pTimeline, void* pScratch, uint32_t scratchSize);
+
+/*
+** midiTimeline* Prototypes
+*/
+uint32_t midiTimelineGetMaxSize(const MIDI_FILE* _pMFembedded, uint32_t* pMaxEvents, uint32_t* pMaxArenaSize);
+bool midiTimelineInit(MIDI_TIMELINE* pTimeline, void* pBuffer, uint32_t bufferSize, uint32_t maxEvents);
+
+/*
+** midiStream* Prototypes
+*/
+void midiStreamInit(MIDI_STREAM* pStream, OnStreamEventCallback_t pOnEventCb, OnPayloadChunkCallback_t pOnPayloadCb, void* pUser);
+bool midiStreamFeed(MIDI_STREAM* pStream, const void* pData, uint32_t size);
+
+/*
+** midiTempoMap* Prototypes
+*/
+uint32_t midiTempoMapBuild(MIDI_FILE* _pMFembedded, MIDI_TEMPO_MAP* pMap, MIDI_TEMPO_POINT* pPoints, uint32_t maxPoints);
+uint64_t midiTempoMapTickToUs(const MIDI_TEMPO_MAP* pMap, uint32_t tick);
+uint32_t midiTempoMapUsToTick(const MIDI_TEMPO_MAP* pMap, uint64_t us);
+
+/*
+** midiBarMap* Prototypes
+*/
+uint32_t midiBarMapBuild(MIDI_FILE* _pMFembedded, MIDI_BAR_MAP* pMap, MIDI_BAR_POINT* pPoints, uint32_t maxPoints);
+bool midiBarMapTickToPos(const MIDI_BAR_MAP* pMap, uint32_t tick, MIDI_BAR_POS* pPos);
+uint32_t midiBarMapPosToTick(const MIDI_BAR_MAP* pMap, const MIDI_BAR_POS* pPos);
+
+/*
+** midiFilter* Prototypes
+*/
+void midiFilterInit(MIDI_FILTER* pFilter, bool bAll);
+void midiFilterSetMsg(MIDI_FILTER* pFilter, tMIDI_MSG iType, bool bWanted);
+void midiFilterSetMeta(MIDI_FILTER* pFilter, tMIDI_META iType, bool bWanted);
 
 
 #endif /* _MIDIFILE_H */
@@ -38,127 +38,188 @@
 #include "midiplayer.h"
 #include "hal/hal_misc.h"
 
-static void dispatchMidiMsg(MIDI_PLAYER* pMidiPlayer, int32_t trackIndex) {
-  MIDI_MSG* msg = &pMidiPlayer->msg[trackIndex];
+static uint32_t readPayload(MIDI_PLAYER* pMidiPlayer, const MIDI_EVENT* pEvent) {
+  // Meta events longer than the buffer are cut, texts are nullterminated.
+  uint32_t size = midiReadEventPayload(pMidiPlayer->pMidiFile, pEvent, pMidiPlayer->payload, META_EVENT_MAX_DATA_SIZE);
 
-  int32_t eventType = msg->bImpliedMsg ? msg->iImpliedMsg : msg->iType;
-  switch (eventType) {
+  memset(&pMidiPlayer->payload[size], 0, sizeof(pMidiPlayer->payload) - size);
+  return size;
+}
+
+static uint32_t readSysEx(MIDI_PLAYER* pMidiPlayer, const MIDI_EVENT* pEvent) {
+  // The sysex callback gets the event as midiReadGetNextMessage() has it: the status, the length as variable length
+  // value and the data behind it, cut at the buffer size.
+  uint8_t* p = pMidiPlayer->payload;
+  uint32_t size = 0, shift = 21;
+
+  p[size++] = pEvent->status;
+  while (shift > 0 && (pEvent->payloadSize >> shift) == 0)
+    shift -= 7;
+  for (; shift > 0; shift -= 7)
+    p[size++] = (uint8_t)(0x80 | ((pEvent->payloadSize >> shift) & 0x7F));
+  p[size++] = (uint8_t)(pEvent->payloadSize & 0x7F);
+
+  return size + midiReadEventPayload(pMidiPlayer->pMidiFile, pEvent, &p[size], META_EVENT_MAX_DATA_SIZE - size);
+}
+
+static void dispatchMetaEvent(MIDI_PLAYER* pMidiPlayer, int32_t trackIndex, const MIDI_EVENT* pEvent) {
+  const MidiPlayerCallbacks_t* cb = &pMidiPlayer->cb;
+  OnMetaTextEventCallback_t pOnTextCb = NULL; // all text events share one signature
+  uint8_t* p = pMidiPlayer->payload;
+  uint32_t size;
+  int32_t tick = pEvent->tick;
+
+  switch (pEvent->data1) {
+    case	metaMIDIPort:
+      if (cb->pOnMetaMIDIPortCb && readPayload(pMidiPlayer, pEvent) >= 1)
+        cb->pOnMetaMIDIPortCb(trackIndex, tick, p[0]);
+      break;
+    case	metaSequenceNumber:
+      if (cb->pOnMetaSequenceNumberCb && readPayload(pMidiPlayer, pEvent) >= 1)
+        cb->pOnMetaSequenceNumberCb(trackIndex, tick, p[0]);
+      break;
+    case	metaTextEvent:
+      pOnTextCb = cb->pOnMetaTextEventCb;
+      break;
+    case	metaCopyright:
+      pOnTextCb = cb->pOnMetaCopyrightCb;
+      break;
+    case	metaTrackName:
+      pOnTextCb = cb->pOnMetaTrackNameCb;
+      break;
+    case	metaInstrument:
+      pOnTextCb = cb->pOnMetaInstrumentCb;
+      break;
+    case	metaLyric:
+      pOnTextCb = cb->pOnMetaLyricCb;
+      break;
+    case	metaMarker:
+      pOnTextCb = cb->pOnMetaMarkerCb;
+      break;
+    case	metaCuePoint:
+      pOnTextCb = cb->pOnMetaCuePointCb;
+      break;
+    case	metaEndSequence:
+      if (cb->pOnMetaEndSequenceCb)
+        cb->pOnMetaEndSequenceCb(trackIndex, tick);
+      break;
+    case	metaSetTempo: {
+      int32_t iMPQN;
+
+      if (readPayload(pMidiPlayer, pEvent) < 3)
+        break;
+
+      iMPQN = (p[0] << 16) | (p[1] << 8) | p[2];
+      if (iMPQN == 0)
+        break;
+
+      setPlaybackTempo(pMidiPlayer->pMidiFile, MICROSECONDS_PER_MINUTE / iMPQN);
+      adjustTimeFactor(pMidiPlayer);
+
+      if (cb->pOnMetaSetTempoCb)
+        cb->pOnMetaSetTempoCb(trackIndex, tick, MICROSECONDS_PER_MINUTE / iMPQN);
+      break;
+    }
+    case	metaSMPTEOffset:
+      if (cb->pOnMetaSMPTEOffsetCb && readPayload(pMidiPlayer, pEvent) >= 5)
+        cb->pOnMetaSMPTEOffsetCb(trackIndex, tick, p[0], p[1], p[2], p[3], p[4]);
+      break;
+    case	metaTimeSig:
+      // TODO: Metronome and thirtyseconds are missing!!!
+      if (cb->pOnMetaTimeSigCb && readPayload(pMidiPlayer, pEvent) >= 2)
+        cb->pOnMetaTimeSigCb(trackIndex, tick, p[0], p[1] * MIDI_NOTE_MINIM / MIDI_NOTE_CROCHET, 0, 0);
+      break;
+    case	metaKeySig: { // TODO: scale is missing!!!
+      uint32_t iKey;
+
+      if (!cb->pOnMetaKeySigCb || readPayload(pMidiPlayer, pEvent) < 2)
+        break;
+
+      if (p[0] & 0x80) // Do some trendy sign extending in reverse :)
+        iKey = ((256 - p[0]) & keyMaskKey) | keyMaskNeg;
+      else
+        iKey = p[0] & keyMaskKey;
+      if (p[1])
+        iKey |= keyMaskMin;
+
+      cb->pOnMetaKeySigCb(trackIndex, tick, iKey, 0);
+      break;
+    }
+    case	metaSequencerSpecific:
+      if (cb->pOnMetaSequencerSpecificCb) {
+        size = readPayload(pMidiPlayer, pEvent);
+        cb->pOnMetaSequencerSpecificCb(trackIndex, tick, p, size);
+      }
+      break;
+  }
+
+  if (pOnTextCb) {
+    readPayload(pMidiPlayer, pEvent);
+    pOnTextCb(trackIndex, tick, (char*)p);
+  }
+}
+
+static void dispatchMidiEvent(MIDI_PLAYER* pMidiPlayer, int32_t trackIndex) {
+  const MIDI_EVENT* pEvent = &pMidiPlayer->event[trackIndex];
+  const MidiPlayerCallbacks_t* cb = &pMidiPlayer->cb;
+  int32_t channel = (pEvent->status & 0x0f) + 1;
+  int32_t tick = pEvent->tick;
+
+  switch (pEvent->status < msgSysEx1 ? pEvent->status & 0xF0 : pEvent->status) {
     case	msgNoteOff:
-      if (pMidiPlayer->cb.pOnNoteOffCb)
-        pMidiPlayer->cb.pOnNoteOffCb(trackIndex, msg->dwAbsPos, msg->MsgData.NoteOff.iChannel, msg->MsgData.NoteOff.iNote);
+      if (cb->pOnNoteOffCb)
+        cb->pOnNoteOffCb(trackIndex, tick, channel, pEvent->data1);
       break;
     case	msgNoteOn:
-      if (pMidiPlayer->cb.pOnNoteOnCb)
-        pMidiPlayer->cb.pOnNoteOnCb(trackIndex, msg->dwAbsPos, msg->MsgData.NoteOn.iChannel, msg->MsgData.NoteOn.iNote, msg->MsgData.NoteOn.iVolume);
+      if (cb->pOnNoteOnCb)
+        cb->pOnNoteOnCb(trackIndex, tick, channel, pEvent->data1, pEvent->data2);
       break;
     case	msgNoteKeyPressure:
-      if (pMidiPlayer->cb.pOnNoteKeyPressureCb)
-        pMidiPlayer->cb.pOnNoteKeyPressureCb(trackIndex, msg->dwAbsPos, msg->MsgData.NoteKeyPressure.iChannel, msg->MsgData.NoteKeyPressure.iNote, msg->MsgData.NoteKeyPressure.iPressure);
+      if (cb->pOnNoteKeyPressureCb)
+        cb->pOnNoteKeyPressureCb(trackIndex, tick, channel, pEvent->data1, pEvent->data2);
       break;
     case	msgControlChange:
-      if (pMidiPlayer->cb.pOnSetParameterCb)
-        pMidiPlayer->cb.pOnSetParameterCb(trackIndex, msg->dwAbsPos, msg->MsgData.NoteParameter.iChannel, msg->MsgData.NoteParameter.iControl, msg->MsgData.NoteParameter.iParam);
+      if (cb->pOnSetParameterCb)
+        cb->pOnSetParameterCb(trackIndex, tick, channel, pEvent->data1, pEvent->data2);
       break;
     case	msgSetProgram:
-      if (pMidiPlayer->cb.pOnSetProgramCb)
-        pMidiPlayer->cb.pOnSetProgramCb(trackIndex, msg->dwAbsPos, msg->MsgData.ChangeProgram.iChannel, msg->MsgData.ChangeProgram.iProgram);
+      if (cb->pOnSetProgramCb)
+        cb->pOnSetProgramCb(trackIndex, tick, channel, pEvent->data1);
       break;
     case	msgChangePressure:
-      if (pMidiPlayer->cb.pOnChangePressureCb)
-        pMidiPlayer->cb.pOnChangePressureCb(trackIndex, msg->dwAbsPos, msg->MsgData.ChangePressure.iChannel, msg->MsgData.ChangePressure.iPressure);
+      if (cb->pOnChangePressureCb)
+        cb->pOnChangePressureCb(trackIndex, tick, channel, pEvent->data1);
       break;
     case	msgSetPitchWheel:
-      if (pMidiPlayer->cb.pOnSetPitchWheelCb)
-        pMidiPlayer->cb.pOnSetPitchWheelCb(trackIndex, msg->dwAbsPos, msg->MsgData.PitchWheel.iChannel, msg->MsgData.PitchWheel.iPitch + 8192);
+      if (cb->pOnSetPitchWheelCb)
+        cb->pOnSetPitchWheelCb(trackIndex, tick, channel, pEvent->data1 | (pEvent->data2 << 7));
       break;
     case	msgMetaEvent:
-      switch (msg->MsgData.MetaEvent.iType) {
-      case	metaMIDIPort:
-        if (pMidiPlayer->cb.pOnMetaMIDIPortCb)
-          pMidiPlayer->cb.pOnMetaMIDIPortCb(trackIndex, msg->dwAbsPos, msg->MsgData.MetaEvent.Data.iMIDIPort);
-        break;
-      case	metaSequenceNumber:
-        if (pMidiPlayer->cb.pOnMetaSequenceNumberCb)
-          pMidiPlayer->cb.pOnMetaSequenceNumberCb(trackIndex, msg->dwAbsPos, msg->MsgData.MetaEvent.Data.iSequenceNumber);
-        break;
-      case	metaTextEvent:
-        if (pMidiPlayer->cb.pOnMetaTextEventCb)
-          pMidiPlayer->cb.pOnMetaTextEventCb(trackIndex, msg->dwAbsPos, msg->MsgData.MetaEvent.Data.Text.pData);
-        break;
-      case	metaCopyright:
-        if (pMidiPlayer->cb.pOnMetaCopyrightCb)
-          pMidiPlayer->cb.pOnMetaCopyrightCb(trackIndex, msg->dwAbsPos, msg->MsgData.MetaEvent.Data.Text.pData);
-        break;
-      case	metaTrackName:
-        if (pMidiPlayer->cb.pOnMetaTrackNameCb)
-          pMidiPlayer->cb.pOnMetaTrackNameCb(trackIndex, msg->dwAbsPos, msg->MsgData.MetaEvent.Data.Text.pData);
-        break;
-      case	metaInstrument:
-        if (pMidiPlayer->cb.pOnMetaInstrumentCb)
-          pMidiPlayer->cb.pOnMetaInstrumentCb(trackIndex, msg->dwAbsPos, msg->MsgData.MetaEvent.Data.Text.pData);
-        break;
-      case	metaLyric:
-        if (pMidiPlayer->cb.pOnMetaLyricCb)
-          pMidiPlayer->cb.pOnMetaLyricCb(trackIndex, msg->dwAbsPos, msg->MsgData.MetaEvent.Data.Text.pData);
-        break;
-      case	metaMarker:
-        if (pMidiPlayer->cb.pOnMetaMarkerCb)
-          pMidiPlayer->cb.pOnMetaMarkerCb(trackIndex, msg->dwAbsPos, msg->MsgData.MetaEvent.Data.Text.pData);
-        break;
-      case	metaCuePoint:
-        if (pMidiPlayer->cb.pOnMetaCuePointCb)
-          pMidiPlayer->cb.pOnMetaCuePointCb(trackIndex, msg->dwAbsPos, msg->MsgData.MetaEvent.Data.Text.pData);
-        break;
-      case	metaEndSequence:
-        if (pMidiPlayer->cb.pOnMetaEndSequenceCb)
-          pMidiPlayer->cb.pOnMetaEndSequenceCb(trackIndex, msg->dwAbsPos);
-        break;
-      case	metaSetTempo:
-        setPlaybackTempo(pMidiPlayer->pMidiFile, msg->MsgData.MetaEvent.Data.Tempo.iBPM);
-        adjustTimeFactor(pMidiPlayer);
-
-        if (pMidiPlayer->cb.pOnMetaSetTempoCb)
-          pMidiPlayer->cb.pOnMetaSetTempoCb(trackIndex, msg->dwAbsPos, msg->MsgData.MetaEvent.Data.Tempo.iBPM);
-        break;
-      case	metaSMPTEOffset:
-        if (pMidiPlayer->cb.pOnMetaSMPTEOffsetCb)
-          pMidiPlayer->cb.pOnMetaSMPTEOffsetCb(trackIndex, msg->dwAbsPos,
-            msg->MsgData.MetaEvent.Data.SMPTE.iHours,
-            msg->MsgData.MetaEvent.Data.SMPTE.iMins,
-            msg->MsgData.MetaEvent.Data.SMPTE.iSecs,
-            msg->MsgData.MetaEvent.Data.SMPTE.iFrames,
-            msg->MsgData.MetaEvent.Data.SMPTE.iFF
-          );
-        break;
-      case	metaTimeSig:
-        // TODO: Metronome and thirtyseconds are missing!!!
-        if (pMidiPlayer->cb.pOnMetaTimeSigCb)
-          pMidiPlayer->cb.pOnMetaTimeSigCb(trackIndex,
-            msg->dwAbsPos,
-            msg->MsgData.MetaEvent.Data.TimeSig.iNom,
-            msg->MsgData.MetaEvent.Data.TimeSig.iDenom / MIDI_NOTE_CROCHET,
-            0, 0
-          );
-        break;
-      case	metaKeySig: // TODO: scale is missing!!!
-        if (pMidiPlayer->cb.pOnMetaKeySigCb)
-          pMidiPlayer->cb.pOnMetaKeySigCb(trackIndex, msg->dwAbsPos, msg->MsgData.MetaEvent.Data.KeySig.iKey, 0);
-        break;
-      case	metaSequencerSpecific:
-        if (pMidiPlayer->cb.pOnMetaSequencerSpecificCb)
-          pMidiPlayer->cb.pOnMetaSequencerSpecificCb(trackIndex, msg->dwAbsPos,
-            msg->MsgData.MetaEvent.Data.Sequencer.pData, msg->MsgData.MetaEvent.Data.Sequencer.iSize
-          );
-        break;
-      }
+      dispatchMetaEvent(pMidiPlayer, trackIndex, pEvent);
       break;
-
     case	msgSysEx1:
     case	msgSysEx2:
-      if (pMidiPlayer->cb.pOnMetaSysExCb)
-        pMidiPlayer->cb.pOnMetaSysExCb(trackIndex, msg->dwAbsPos, msg->MsgData.SysEx.pData, msg->MsgData.SysEx.iSize);
+      if (cb->pOnMetaSysExCb) {
+        uint32_t size = readSysEx(pMidiPlayer, pEvent);
+        cb->pOnMetaSysExCb(trackIndex, tick, pMidiPlayer->payload, size);
+      }
       break;
-    }
+  }
+}
+
+static void loadNextEvent(MIDI_PLAYER* pMidiPlayer, int32_t iTrack) {
+  // The player counts down the ticks to the next event of every track in deltaTime.
+  MIDI_FILE_TRACK* pTrack = &pMidiPlayer->pMidiFile->Track[iTrack];
+  MIDI_EVENT* pEvent = &pMidiPlayer->event[iTrack];
+  uint32_t lastTick = pEvent->tick;
+
+  if (!midiReadGetNextEvent(pMidiPlayer->pMidiFile, iTrack, pEvent)) {
+    pTrack->ptrNew = pTrack->pEndNew; // invalid data ends the track
+    return;
+  }
+
+  pTrack->deltaTime += pEvent->tick - lastTick;
+  pTrack->debugLastMsgDt = pEvent->tick - lastTick;
 }
 
 void midiplayer_init(MIDI_PLAYER* mpl, MidiPlayerCallbacks_t callbacks) {
@@ -167,14 +228,26 @@ void midiplayer_init(MIDI_PLAYER* mpl, MidiPlayerCallbacks_t callbacks) {
 }
 
 bool midiPlayerOpenFile(MIDI_PLAYER* pMidiPlayer, const char* pFileName) {
+  if (pMidiPlayer->pMidiFile)
+    midiFileClose(pMidiPlayer->pMidiFile); // give the previous file back to the pool
+
   pMidiPlayer->pMidiFile = midiFileOpen(pFileName);
   if (!pMidiPlayer->pMidiFile)
     return false;
 
+  midiFileSetCacheMissCallback(pMidiPlayer->pMidiFile, pMidiPlayer->cb.pOnCacheMissCb);
+
+  // Tracks of MIDI 1 files are read interleaved, which would thrash a single cache window. With MIDI_CACHE_WARM_UP
+  // midiFileOpen() already did this and filled the windows, so they are kept.
+  if (pMidiPlayer->pMidiFile->Header.iVersion == 1 && midiReadGetNumTracks(pMidiPlayer->pMidiFile) > 1 &&
+      pMidiPlayer->pMidiFile->cacheMode != cacheModePerTrack)
+    midiFileSetCacheMode(pMidiPlayer->pMidiFile, cacheModePerTrack, 0);
+
   // Load initial midi events
   for (int iTrack = 0; iTrack < midiReadGetNumTracks(pMidiPlayer->pMidiFile); iTrack++) {
-    midiReadGetNextMessage(pMidiPlayer->pMidiFile, iTrack, &pMidiPlayer->msg[iTrack]);
-    pMidiPlayer->pMidiFile->Track[iTrack].deltaTime = pMidiPlayer->msg[iTrack].dt;
+    pMidiPlayer->event[iTrack].tick = 0;
+    pMidiPlayer->pMidiFile->Track[iTrack].deltaTime = 0;
+    loadNextEvent(pMidiPlayer, iTrack);
   }
 
   pMidiPlayer->startTime = hal_clock() * 1000;
@@ -224,7 +297,7 @@ void adjustTimeFactor(MIDI_PLAYER* pMp) {
 
 bool isItTimeToFireThisEvent(MIDI_PLAYER* pMp, int iTrack) {
   if (pMp->pMidiFile->Track[iTrack].deltaTime <= 0 && !pMp->trackIsFinished) {
-    dispatchMidiMsg(pMp, iTrack); // shoot
+    dispatchMidiEvent(pMp, iTrack); // shoot
 
     // Debug 1/2
     int32_t expectedWaitTimeMs = pMp->pMidiFile->Track[iTrack].debugLastMsgDt * pMp->lastUsPerTick / 1000;
@@ -236,12 +309,10 @@ bool isItTimeToFireThisEvent(MIDI_PLAYER* pMp, int iTrack) {
           jitterMs);
     // ---
 
-    midiReadGetNextMessage(pMp->pMidiFile, iTrack, &pMp->msg[iTrack]); // reload
-    pMp->pMidiFile->Track[iTrack].deltaTime += pMp->msg[iTrack].dt;
+    loadNextEvent(pMp, iTrack); // reload
 
     // Debug 2/2
     pMp->pMidiFile->Track[iTrack].debugLastClock = hal_clock();
-    pMp->pMidiFile->Track[iTrack].debugLastMsgDt = pMp->msg[iTrack].dt;
     // ---
 
     return true;
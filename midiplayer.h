@@ -27,10 +27,10 @@ typedef void(*OnMetaSMPTEOffsetCallback_t)(int32_t track, int32_t tick, uint32_t
 typedef void(*OnMetaTimeSigCallback_t)(int32_t track, int32_t tick, int32_t nom, int32_t denom, int32_t metronome, int32_t thirtyseconds);
 typedef void(*OnMetaKeySigCallback_t)(int32_t track, int32_t tick, uint32_t key, uint32_t scale);
 typedef void(*OnMetaSequencerSpecificCallback_t)(int32_t track, int32_t tick, void* pData, uint32_t size);
-typedef void(*OnMetaSysExCallback_t)(int32_t track, int32_t tick, void* pData, uint32_t size);
+typedef void(*OnMetaSysExCallback_t)(int32_t track, int32_t tick, void* pData, uint32_t size); // the whole event: status, length and data
 
 // Custom callbacks
-// TODO: onCacheMiss()
+// OnCacheMissCallback_t is declared in midifile.h
 
 typedef struct {
   OnNoteOffCallback_t pOnNoteOffCb;
@@ -56,11 +56,13 @@ typedef struct {
   OnMetaKeySigCallback_t pOnMetaKeySigCb;
   OnMetaSequencerSpecificCallback_t pOnMetaSequencerSpecificCb;
   OnMetaSysExCallback_t pOnMetaSysExCb;
+  OnCacheMissCallback_t pOnCacheMissCb;
 } MidiPlayerCallbacks_t;
 
 typedef struct {
   _MIDI_FILE* pMidiFile;
-  MIDI_MSG msg[MAX_MIDI_TRACKS];
+  MIDI_EVENT event[MAX_MIDI_TRACKS]; // next event of every track, payloads are only read when they are dispatched
+  uint8_t payload[META_EVENT_MAX_DATA_SIZE + 1]; // payload of the event being dispatched (+ 1 byte for texts' nullterminator)
   int32_t startTime;
   int32_t currentTick;
   int32_t lastTick;
@@ -0,0 +1,988 @@
+/*
+ * readertest.c - Checks the readers of midifile.c against a simple reference parser
+ *
+ *  Usage: readertest [MIDI files]
+ *
+ *  Every file is parsed once by the reference parser below, which only knows the file format, and the library has to
+ *  give the same results. Random format 1 files are checked after the given ones. Returns 0, if nothing differed.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation; either version 2 of
+ *  the License,or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include "../midifile.h"
+#include "../hal/hal_posix.h"
+
+#define MAX_FILE_SIZE	(1 << 20)
+#define MAX_EVENTS	(1 << 18)
+#define MAX_SEEK_POINTS	1024
+#define MAX_SNAPSHOTS	16
+#define MAX_MAP_POINTS	256
+#define NUM_SEEKS	16
+static long numChecks = 0;
+static long numFailed = 0;
+
+#define CHECK(cond, ...) do { \
+    numChecks++; \
+    if (!(cond)) { \
+      if (numFailed++ < 20) { printf("%s: ", pFileName); printf(__VA_ARGS__); printf("\n"); } \
+    } \
+  } while (0)
+
+// ---- HAL functions hal_posix.h leaves to the application ----
+
+uint32_t hal_clock() {
+  return (uint32_t)clock();
+}
+
+void hal_printfError(const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+}
+
+void hal_printfWarning(char* format, ...) {
+  // broken test files warn on purpose
+}
+
+void hal_printfSuccess(char* format, ...) {
+}
+
+void hal_printfInfo(char* format, ...) {
+}
+
+// ---- Reference parser ----
+// Straight from the file format: no cache, no peeking, one byte after another.
+
+static uint8_t fileData[MAX_FILE_SIZE];
+static uint32_t fileSize;
+static MIDI_EVENT refEvents[MAX_EVENTS];
+static uint32_t refFirst[MAX_MIDI_TRACKS + 1]; // index of the first event of each track, refFirst[numRefTracks] is the end
+static int32_t numRefTracks;
+static uint16_t refPPQN;
+
+static uint32_t refGetDword(uint32_t pos) {
+  return (fileData[pos] << 24) | (fileData[pos + 1] << 16) | (fileData[pos + 2] << 8) | fileData[pos + 3];
+}
+
+static bool refReadVarLen(uint32_t* pPos, uint32_t endPos, uint32_t* pValue) {
+  *pValue = 0;
+  for (int i = 0; i < 4; ++i) {
+    if (*pPos >= endPos)
+      return false;
+
+    *pValue = (*pValue << 7) | (fileData[*pPos] & 0x7F);
+    if (!(fileData[(*pPos)++] & 0x80))
+      return true;
+  }
+
+  return false;
+}
+
+static void refParseTrack(int32_t iTrack, uint32_t pos, uint32_t endPos, uint32_t* pNumEvents) {
+  uint32_t tick = 0, dt, length;
+  uint8_t runningStatus = 0;
+
+  // bytes behind the end of the file can't be read
+  if (endPos > fileSize)
+    endPos = fileSize;
+
+  while (pos < endPos && *pNumEvents < MAX_EVENTS) {
+    MIDI_EVENT event;
+    uint8_t status;
+
+    memset(&event, 0, sizeof(event));
+    if (!refReadVarLen(&pos, endPos, &dt) || pos >= endPos)
+      return;
+
+    status = fileData[pos];
+    if (status & 0x80)
+      pos++;
+    else if (runningStatus)
+      status = runningStatus;
+    else
+      return;
+
+    event.tick = tick + dt;
+    event.status = status;
+    event.track = (uint8_t)iTrack;
+    if (status == msgMetaEvent || status == msgSysEx1 || status == msgSysEx2) {
+      if (status == msgMetaEvent) {
+        if (pos >= endPos)
+          return;
+        event.data1 = fileData[pos++];
+      }
+
+      if (!refReadVarLen(&pos, endPos, &length))
+        return;
+
+      if (length > endPos - pos)
+        return; // cut off by the end of the track
+
+      event.payloadPos = pos;
+      event.payloadSize = length;
+      pos += length;
+      runningStatus = 0;
+    } else if (status > msgSysEx1) {
+      return; // system messages don't belong into files
+    } else {
+      uint32_t numData = (status & 0xF0) == msgSetProgram || (status & 0xF0) == msgChangePressure ? 1 : 2;
+
+      if (pos + numData > endPos)
+        return;
+
+      event.data1 = fileData[pos];
+      event.data2 = numData > 1 ? fileData[pos + 1] : 0;
+      pos += numData;
+      runningStatus = status;
+    }
+
+    tick += dt;
+    refEvents[(*pNumEvents)++] = event;
+  }
+}
+
+static bool refParse() {
+  uint32_t pos, numEvents = 0;
+
+  if (fileSize < 14 || memcmp(fileData, "MThd", 4) != 0)
+    return false;
+
+  numRefTracks = (fileData[10] << 8) | fileData[11];
+  if (numRefTracks > MAX_MIDI_TRACKS)
+    numRefTracks = MAX_MIDI_TRACKS;
+  refPPQN = (uint16_t)((fileData[12] << 8) | fileData[13]);
+
+  pos = 8 + refGetDword(4);
+  for (int32_t iTrack = 0; iTrack < numRefTracks; ++iTrack) {
+    uint32_t size = pos + 8 <= fileSize ? refGetDword(pos + 4) : 0;
+
+    refFirst[iTrack] = numEvents;
+    refParseTrack(iTrack, pos + 8, pos + 8 + size, &numEvents);
+    pos += 8 + size;
+  }
+  refFirst[numRefTracks] = numEvents;
+  return true;
+}
+
+static bool refIsBefore(const MIDI_EVENT* pEvent, const MIDI_EVENT* pOther) {
+  // order of the merged tracks: by tick, meta events and sysex first, then by track
+  if (pEvent->tick != pOther->tick)
+    return pEvent->tick < pOther->tick;
+
+  if ((pEvent->status >= msgSysEx1) != (pOther->status >= msgSysEx1))
+    return pEvent->status >= msgSysEx1;
+
+  return pEvent->track < pOther->track;
+}
+
+static uint32_t refMerge(uint32_t* pOrder) {
+  // takes the first of the next events of all tracks until none is left, which keeps the order within the tracks
+  uint32_t next[MAX_MIDI_TRACKS], num = 0;
+
+  for (int32_t iTrack = 0; iTrack < numRefTracks; ++iTrack)
+    next[iTrack] = refFirst[iTrack];
+
+  for (;;) {
+    int32_t iFirst = -1;
+
+    for (int32_t iTrack = 0; iTrack < numRefTracks; ++iTrack)
+      if (next[iTrack] < refFirst[iTrack + 1] &&
+          (iFirst < 0 || refIsBefore(&refEvents[next[iTrack]], &refEvents[next[iFirst]])))
+        iFirst = iTrack;
+
+    if (iFirst < 0)
+      return num;
+
+    pOrder[num++] = next[iFirst]++;
+  }
+}
+
+static const MIDI_EVENT* refFirstAt(int32_t iTrack, uint32_t tick) {
+  // first event of the track at or after tick, NULL behind its end
+  for (uint32_t i = refFirst[iTrack]; i < refFirst[iTrack + 1]; ++i)
+    if (refEvents[i].tick >= tick)
+      return &refEvents[i];
+
+  return NULL;
+}
+
+static uint32_t refLastTick() {
+  uint32_t lastTick = 0;
+
+  for (uint32_t i = 0; i < refFirst[numRefTracks]; ++i)
+    if (refEvents[i].tick > lastTick)
+      lastTick = refEvents[i].tick;
+
+  return lastTick;
+}
+
+// ---- Generated files ----
+// The files in MIDIFiles/ have a single track each. Random format 1 files cover what only several tracks show: events
+// of many tracks at the same tick, channels used by several tracks, tempo changes and time signatures in any track.
+
+#define NUM_GENERATED	40
+
+static uint32_t genPos;
+
+static void genByte(uint8_t value) {
+  if (genPos < MAX_FILE_SIZE)
+    fileData[genPos++] = value;
+}
+
+static void genDword(uint32_t value) {
+  for (int shift = 24; shift >= 0; shift -= 8)
+    genByte((uint8_t)(value >> shift));
+}
+
+static void genVarLen(uint32_t value) {
+  uint8_t bytes[4];
+  int num = 0;
+
+  do {
+    bytes[num++] = value & 0x7F;
+    value >>= 7;
+  } while (value && num < 4);
+
+  while (--num > 0)
+    genByte(bytes[num] | 0x80);
+  genByte(bytes[0]);
+}
+
+static uint32_t genDeltaTime() {
+  // many events at the same tick, a few long gaps
+  int r = rand() % 10;
+
+  return r < 4 ? 0 : r < 9 ? 1 + rand() % 120 : rand() % 20000;
+}
+
+static void genBrokenEvent() {
+  // an event which has to end the track in every reader, as the last bytes of the track chunk
+  static const uint8_t sysStatus[] = { 0xF1, 0xF2, 0xF3, 0xF6, 0xF8, 0xFA, 0xFE };
+
+  switch (rand() % 4) {
+    case 0: // system common and realtime messages don't belong into files
+      genVarLen(genDeltaTime());
+      genByte(sysStatus[rand() % sizeof(sysStatus)]);
+      genByte(0x10);
+      genByte(0x20);
+      break;
+    case 1: // data bytes cut off
+      genVarLen(genDeltaTime());
+      genByte((uint8_t)(msgNoteOn | (rand() % 4)));
+      genByte(60);
+      break;
+    case 2: // payload cut off
+      genVarLen(genDeltaTime());
+      genByte(msgMetaEvent);
+      genByte(metaTextEvent);
+      genVarLen(50 + rand() % 200);
+      for (int i = 0; i < 10; ++i)
+        genByte('x');
+      break;
+    default: // delta time cut off
+      genByte(0x81);
+      break;
+  }
+}
+
+static void genTrack(uint32_t numEvents) {
+  uint32_t start = genPos, end;
+  uint8_t runningStatus = 0;
+
+  genDword(0x4D54726B); // "MTrk", the size is set at the end
+  genDword(0);
+  for (uint32_t i = 0; i < numEvents; ++i) {
+    static const uint8_t types[] = { msgNoteOn, msgNoteOff, msgNoteKeyPressure, msgControlChange, msgSetProgram,
+        msgChangePressure, msgSetPitchWheel };
+    int r = rand() % 100;
+
+    genVarLen(genDeltaTime());
+    if (r < 3) {
+      uint32_t usPerQuarter = 200000 + rand() % 1000000;
+
+      genByte(msgMetaEvent);
+      genByte(metaSetTempo);
+      genVarLen(3);
+      genByte((uint8_t)(usPerQuarter >> 16));
+      genByte((uint8_t)(usPerQuarter >> 8));
+      genByte((uint8_t)usPerQuarter);
+      runningStatus = 0;
+    } else if (r < 5) {
+      genByte(msgMetaEvent);
+      genByte(metaTimeSig);
+      genVarLen(4);
+      genByte((uint8_t)(1 + rand() % 7));
+      genByte((uint8_t)(rand() % 5));
+      genByte(24);
+      genByte(8);
+      runningStatus = 0;
+    } else if (r < 8) {
+      uint32_t length = rand() % 300; // long enough for two byte lengths and windows smaller than the payload
+
+      genByte(r < 7 ? msgMetaEvent : msgSysEx1);
+      if (r < 7)
+        genByte(metaTextEvent);
+      genVarLen(length);
+      for (uint32_t j = 0; j < length; ++j)
+        genByte((uint8_t)(rand() & 0x7F));
+      runningStatus = 0;
+    } else {
+      // four channels for all tracks, so the chase depends on the order of the tracks
+      uint8_t status = types[rand() % (sizeof(types) / sizeof(types[0]))];
+
+      status |= rand() % 4; // not in the line above, the order of the calls would be up to the compiler
+
+      if (status != runningStatus || rand() % 4 == 0)
+        genByte(status);
+      runningStatus = status;
+      genByte((uint8_t)(rand() & 0x7F));
+      if ((status & 0xF0) != msgSetProgram && (status & 0xF0) != msgChangePressure)
+        genByte((uint8_t)(rand() & 0x7F));
+    }
+  }
+
+  if (rand() % 8 == 0)
+    genBrokenEvent();
+  else {
+    genVarLen(genDeltaTime());
+    genByte(msgMetaEvent);
+    genByte(metaEndSequence);
+    genVarLen(0);
+  }
+
+  end = genPos;
+  genPos = start + 4;
+  genDword(end - start - 8);
+  genPos = end;
+}
+
+static void genFile() {
+  int32_t numTracks = 2 + rand() % (MAX_MIDI_TRACKS - 1);
+  uint16_t PPQN = (uint16_t)(rand() % 10 == 0 ? 0 : 24 * (1 + rand() % 40)); // 0 makes the default intervals 0
+
+  genPos = 0;
+  genDword(0x4D546864); // "MThd"
+  genDword(6);
+  genByte(0);
+  genByte(1);
+  genByte((uint8_t)(numTracks >> 8));
+  genByte((uint8_t)numTracks);
+  genByte((uint8_t)(PPQN >> 8));
+  genByte((uint8_t)PPQN);
+  for (int32_t iTrack = 0; iTrack < numTracks; ++iTrack)
+    genTrack(rand() % 8 == 0 ? 0 : rand() % 400);
+
+  fileSize = genPos;
+}
+
+// ---- Checks ----
+
+typedef enum {
+  modeMemory,       // midiFileOpenMemory(), no cache at all
+  modeSingle,       // one window for the whole file
+  modePerTrack,     // a window per track
+  modeSmallWindows, // windows smaller than some events, and tracks beyond the budget
+  modeBlocks,       // a few small blocks, so they are replaced all the time
+  numModes
+} tCHECK_MODE;
+
+static const char* modeNames[numModes] = { "memory", "single window", "window per track", "small windows", "blocks" };
+static const char* pFileName;
+static uint32_t mergeOrder[MAX_EVENTS];
+static uint32_t numMerged;
+static uint32_t seekTicks[NUM_SEEKS];
+
+static bool sameEvent(const MIDI_EVENT* pEvent, const MIDI_EVENT* pRef) {
+  return pEvent->tick == pRef->tick && pEvent->status == pRef->status && pEvent->data1 == pRef->data1 &&
+      pEvent->data2 == pRef->data2 && pEvent->track == pRef->track && pEvent->payloadPos == pRef->payloadPos &&
+      pEvent->payloadSize == pRef->payloadSize;
+}
+
+static void checkSeek(MIDI_FILE* pMF, const char* pMode) {
+  // the next event after a seek is the first one at or after the tick, in any order of seeks
+  MIDI_EVENT event;
+
+  for (int32_t iTrack = 0; iTrack < numRefTracks; ++iTrack)
+    for (int i = 0; i < NUM_SEEKS; ++i) {
+      const MIDI_EVENT* pRef = refFirstAt(iTrack, seekTicks[i]);
+      bool bRead;
+
+      CHECK(midiReadSeek(pMF, iTrack, seekTicks[i], NULL), "%s: seek failed", pMode);
+      bRead = midiReadGetNextEvent(pMF, iTrack, &event);
+      CHECK(bRead == (pRef != NULL) && (!bRead || sameEvent(&event, pRef)), "%s: track %d seek to %u differs", pMode,
+          iTrack, seekTicks[i]);
+    }
+}
+
+static bool sameSeekPoints(const MIDI_SEEK_POINT* pPoints, const MIDI_SEEK_POINT* pOther, uint32_t num) {
+  // field by field, the padding of the points is never written
+  for (uint32_t i = 0; i < num; ++i)
+    if (pPoints[i].tick != pOther[i].tick || pPoints[i].ptr != pOther[i].ptr ||
+        pPoints[i].status != pOther[i].status || pPoints[i].msgStatus != pOther[i].msgStatus)
+      return false;
+
+  return true;
+}
+
+static bool sameBarPoints(const MIDI_BAR_POINT* pPoints, const MIDI_BAR_POINT* pOther, uint32_t num) {
+  for (uint32_t i = 0; i < num; ++i)
+    if (pPoints[i].tick != pOther[i].tick || pPoints[i].bar != pOther[i].bar || pPoints[i].nom != pOther[i].nom ||
+        pPoints[i].denom != pOther[i].denom || pPoints[i].ticksPerBeat != pOther[i].ticksPerBeat)
+      return false;
+
+  return true;
+}
+
+static MIDI_FILE* openFile(tCHECK_MODE mode) {
+  static uint8_t blocks[8 * 256];
+  MIDI_FILE* pMF = mode == modeMemory ? midiFileOpenMemory(fileData, fileSize) : midiFileOpen(pFileName);
+
+  if (pMF && mode == modePerTrack)
+    midiFileSetCacheMode(pMF, cacheModePerTrack, 0);
+  else if (pMF && mode == modeSmallWindows)
+    midiFileSetCacheMode(pMF, cacheModePerTrack, TRACK_CACHE_MIN_SIZE * 4);
+  else if (pMF && mode == modeBlocks)
+    midiFileSetCacheBlocks(pMF, blocks, 256, 8);
+
+  return pMF;
+}
+
+static void checkTracks(MIDI_FILE* pMF, const char* pMode) {
+  // every track read with midiReadGetNextEvent(), which goes through the cache like every other reader, payloads
+  // included
+  uint8_t payload[256];
+  MIDI_EVENT event;
+
+  CHECK(midiReadGetNumTracks(pMF) == numRefTracks, "%s: %d tracks, expected %d", pMode, midiReadGetNumTracks(pMF),
+      numRefTracks);
+  for (int32_t iTrack = 0; iTrack < numRefTracks; ++iTrack) {
+    uint32_t iEvent = refFirst[iTrack];
+
+    while (midiReadGetNextEvent(pMF, iTrack, &event)) {
+      if (iEvent >= refFirst[iTrack + 1]) {
+        CHECK(false, "%s: track %d has more than %u events", pMode, iTrack, refFirst[iTrack + 1] - refFirst[iTrack]);
+        break;
+      }
+
+      CHECK(sameEvent(&event, &refEvents[iEvent]), "%s: track %d event %u differs", pMode, iTrack,
+          iEvent - refFirst[iTrack]);
+      if (event.payloadSize > 0 && event.payloadPos + event.payloadSize <= fileSize) {
+        uint32_t num = event.payloadSize < sizeof(payload) ? event.payloadSize : sizeof(payload);
+
+        CHECK(midiReadEventPayload(pMF, &event, payload, num) == num &&
+            memcmp(payload, &fileData[event.payloadPos], num) == 0, "%s: track %d payload of event %u differs",
+            pMode, iTrack, iEvent - refFirst[iTrack]);
+      }
+      iEvent++;
+    }
+
+    CHECK(iEvent == refFirst[iTrack + 1], "%s: track %d ends after %u of %u events", pMode, iTrack,
+        iEvent - refFirst[iTrack], refFirst[iTrack + 1] - refFirst[iTrack]);
+  }
+}
+
+static void checkSharedWindow(MIDI_FILE* pMF) {
+  // tracks beyond the budget share a window instead of reading byte by byte, so a fetch brings many bytes
+  MIDI_CACHE_STATS stats;
+
+  CHECK(midiFileGetCacheStats(pMF, &stats) && stats.fetches * 16 <= fileSize + 16 * (uint32_t)numRefTracks,
+      "small windows: %u fetches for %u bytes", stats.fetches, fileSize);
+}
+
+static void checkStats(MIDI_FILE* pMF, tCHECK_MODE mode) {
+  // hits and misses count the reads in the same way in every cache mode, so the same reads give about the same sum.
+  // Windows and blocks only differ in the peeks across their borders, which are read again.
+  static uint32_t singleReads;
+  MIDI_CACHE_STATS stats;
+  uint32_t reads;
+
+  if (mode == modeMemory || !midiFileGetCacheStats(pMF, &stats))
+    return;
+
+  reads = stats.hits + stats.misses;
+  CHECK(stats.misses <= stats.fetches, "%s: %u misses, but %u fetches", modeNames[mode], stats.misses, stats.fetches);
+  if (mode == modeSingle)
+    singleReads = reads;
+  else
+    CHECK(reads * 4 >= singleReads * 3 && reads * 4 <= singleReads * 5, "%s: %u reads, %u with a single window",
+        modeNames[mode], reads, singleReads);
+}
+
+static void checkMerge(MIDI_FILE* pMF) {
+  // the tracks are at their ends after checkTracks(), the merge starts where they are, so they are rewound first
+  MIDI_MERGE merge;
+  MIDI_EVENT event;
+  uint32_t num = 0;
+
+  for (int32_t iTrack = 0; iTrack < numRefTracks; ++iTrack)
+    midiReadSeek(pMF, iTrack, 0, NULL);
+
+  midiReadInitMerge(pMF, &merge);
+  while (midiReadGetNextMergedEvent(pMF, &merge, &event) && num < numMerged) {
+    CHECK(sameEvent(&event, &refEvents[mergeOrder[num]]), "merge: event %u differs", num);
+    num++;
+  }
+  CHECK(num == numMerged, "merge: %u of %u events", num, numMerged);
+}
+
+static void checkTimelineEvents(const MIDI_TIMELINE* pTimeline, const char* pName) {
+  CHECK(pTimeline->numEvents == numMerged, "%s: %u of %u events", pName, pTimeline->numEvents, numMerged);
+  for (uint32_t i = 0; i < pTimeline->numEvents && i < numMerged; ++i) {
+    const MIDI_EVENT* pRef = &refEvents[mergeOrder[i]];
+    uint32_t num = pRef->payloadPos + pRef->payloadSize <= fileSize ? pRef->payloadSize : 0;
+
+    CHECK(pTimeline->pTick[i] == pRef->tick && pTimeline->pStatus[i] == pRef->status &&
+        pTimeline->pData1[i] == pRef->data1 && pTimeline->pData2[i] == pRef->data2 &&
+        pTimeline->pTrack[i] == pRef->track && (num == 0 || (pTimeline->pPayloadSize[i] == num &&
+        memcmp(&pTimeline->pArena[pTimeline->pPayloadOffset[i]], &fileData[pRef->payloadPos], num) == 0)),
+        "%s: event %u differs", pName, i);
+  }
+}
+
+static void checkTimeline(MIDI_FILE* pMF) {
+  // midiReadTimeline() and midiReadTimelineParallel(), which decodes the tracks into the scratch buffer first
+  static uint8_t buffer[MAX_EVENTS * MIDI_TIMELINE_BYTES_PER_EVENT + MAX_FILE_SIZE];
+  static MIDI_EVENT scratch[MAX_FILE_SIZE / 2];
+  MIDI_TIMELINE timeline;
+  uint32_t maxEvents, size = midiTimelineGetMaxSize(pMF, &maxEvents, NULL);
+
+  if (size > sizeof(buffer))
+    return;
+
+  CHECK(midiTimelineInit(&timeline, buffer, size, maxEvents) && midiReadTimeline(pMF, &timeline), "timeline failed");
+  checkTimelineEvents(&timeline, "timeline");
+
+  CHECK(midiTimelineInit(&timeline, buffer, size, maxEvents) &&
+      midiReadTimelineParallel(pMF, &timeline, scratch, maxEvents * sizeof(MIDI_EVENT)), "parallel timeline failed");
+  checkTimelineEvents(&timeline, "parallel timeline");
+  CHECK(maxEvents == 0 || !midiReadTimelineParallel(pMF, &timeline, scratch, (maxEvents - 1) * sizeof(MIDI_EVENT)),
+      "parallel timeline: too small scratch buffer taken");
+}
+
+static void checkSeekIndex(MIDI_FILE* pMF) {
+  // seeks through indexes of any size, down to less points than tracks
+  static MIDI_SEEK_POINT seekPoints[MAX_SEEK_POINTS];
+
+  for (uint32_t maxPoints = 1; maxPoints <= MAX_SEEK_POINTS; maxPoints *= 8) {
+    uint32_t numSeekPoints = midiFileBuildSeekIndex(pMF, seekPoints, maxPoints, 0);
+
+    CHECK(numSeekPoints <= maxPoints, "seek index: %u of %u points", numSeekPoints, maxPoints);
+    checkSeek(pMF, "seek index");
+  }
+}
+
+static void checkTempoMap(MIDI_FILE* pMF) {
+  // the tempo map against the tempo changes in merged order
+  static MIDI_TEMPO_POINT tempoPoints[MAX_MAP_POINTS];
+  MIDI_TEMPO_MAP tempoMap;
+  uint32_t lastTick = refLastTick();
+
+  if (refPPQN == 0 || (refPPQN & 0x8000) ||
+      midiTempoMapBuild(pMF, &tempoMap, tempoPoints, MAX_MAP_POINTS) > MAX_MAP_POINTS)
+    return;
+
+  CHECK(tempoMap.lastTick == lastTick, "tempo map: last tick %u, expected %u", tempoMap.lastTick, lastTick);
+  for (int i = 0; i < NUM_SEEKS; ++i) {
+    uint32_t tick = seekTicks[i], segmentTick = 0, usPerQuarter = MICROSECONDS_PER_MINUTE / MIDI_BPM_DEFAULT;
+    uint64_t us = 0;
+
+    // replays the changes up to tick, each one holds from its tick on
+    for (uint32_t iMerged = 0; iMerged < numMerged; ++iMerged) {
+      const MIDI_EVENT* pEvent = &refEvents[mergeOrder[iMerged]];
+      const uint8_t* pData = &fileData[pEvent->payloadPos];
+
+      if (pEvent->tick > tick)
+        break;
+      if (pEvent->status == msgMetaEvent && pEvent->data1 == metaSetTempo && pEvent->payloadSize >= 3 &&
+          (pData[0] | pData[1] | pData[2])) {
+        us += (uint64_t)(pEvent->tick - segmentTick) * usPerQuarter / refPPQN;
+        segmentTick = pEvent->tick;
+        usPerQuarter = (pData[0] << 16) | (pData[1] << 8) | pData[2];
+      }
+    }
+
+    us += (uint64_t)(tick - segmentTick) * usPerQuarter / refPPQN;
+    CHECK(midiTempoMapTickToUs(&tempoMap, tick) == us, "tempo map: tick %u differs", tick);
+    CHECK(midiTempoMapUsToTick(&tempoMap, us) >= tick &&
+        midiTempoMapTickToUs(&tempoMap, midiTempoMapUsToTick(&tempoMap, us)) == us, "tempo map: us of tick %u",
+        tick);
+  }
+}
+
+static void checkChase(MIDI_FILE* pMF) {
+  // the channel state is every controller, program, pressure and pitch wheel event before the tick, in merged order
+  static MIDI_CHASE_SNAPSHOT snapshots[MAX_SNAPSHOTS];
+  MIDI_CHASE_SNAPSHOT state, refState;
+  MIDI_EVENT event;
+
+  for (int bIndex = 0; bIndex < 2; ++bIndex) {
+    midiFileBuildChaseIndex(pMF, snapshots, bIndex ? MAX_SNAPSHOTS : 0, 0);
+    for (int i = 0; i < NUM_SEEKS; ++i) {
+      memset(&refState, MIDI_CHANNEL_UNSET, sizeof(refState));
+      refState.tick = seekTicks[i];
+      for (uint32_t iMerged = 0; iMerged < numMerged && refEvents[mergeOrder[iMerged]].tick < seekTicks[i]; ++iMerged) {
+        const MIDI_EVENT* pEvent = &refEvents[mergeOrder[iMerged]];
+        MIDI_CHANNEL_STATE* pChannel = &refState.channel[pEvent->status & 0x0F];
+
+        if (pEvent->status >= msgSysEx1)
+          continue;
+        if ((pEvent->status & 0xF0) == msgControlChange)
+          pChannel->controller[pEvent->data1 & 0x7F] = pEvent->data2;
+        else if ((pEvent->status & 0xF0) == msgSetProgram)
+          pChannel->program = pEvent->data1;
+        else if ((pEvent->status & 0xF0) == msgChangePressure)
+          pChannel->pressure = pEvent->data1;
+        else if ((pEvent->status & 0xF0) == msgSetPitchWheel)
+          pChannel->pitchWheel = (uint16_t)(pEvent->data1 | (pEvent->data2 << 7));
+      }
+
+      CHECK(midiReadChase(pMF, seekTicks[i], &state) && memcmp(&state, &refState, sizeof(state)) == 0,
+          "chase: state at %u differs", seekTicks[i]);
+      for (int32_t iTrack = 0; iTrack < numRefTracks; ++iTrack) {
+        const MIDI_EVENT* pRef = refFirstAt(iTrack, seekTicks[i]);
+        bool bRead = midiReadGetNextEvent(pMF, iTrack, &event);
+
+        CHECK(bRead == (pRef != NULL) && (!bRead || sameEvent(&event, pRef)), "chase: track %d at %u differs",
+            iTrack, seekTicks[i]);
+      }
+    }
+  }
+}
+
+static void checkBarMap(MIDI_FILE* pMF) {
+  // the bar map against the time signatures in merged order
+  static MIDI_BAR_POINT barPoints[MAX_MAP_POINTS];
+  MIDI_BAR_MAP barMap;
+
+  if (refPPQN == 0 || (refPPQN & 0x8000) ||
+      midiBarMapBuild(pMF, &barMap, barPoints, MAX_MAP_POINTS) > MAX_MAP_POINTS)
+    return;
+
+  for (int i = 0; i < NUM_SEEKS; ++i) {
+    uint32_t tick = seekTicks[i], nom = 4, ticksPerBeat = refPPQN, barTick = 0, bar = 0;
+    MIDI_BAR_POS pos;
+
+    // replays the time signatures up to tick, each one starts a bar
+    for (uint32_t iMerged = 0; iMerged < numMerged; ++iMerged) {
+      const MIDI_EVENT* pEvent = &refEvents[mergeOrder[iMerged]];
+      const uint8_t* pData = &fileData[pEvent->payloadPos];
+
+      if (pEvent->tick > tick)
+        break;
+      if (pEvent->status == msgMetaEvent && pEvent->data1 == metaTimeSig && pEvent->payloadSize >= 2) {
+        uint32_t ticksPerBar = nom * ticksPerBeat;
+
+        bar += (pEvent->tick - barTick + ticksPerBar - 1) / ticksPerBar;
+        barTick = pEvent->tick;
+        nom = pData[0] ? pData[0] : 4;
+        ticksPerBeat = refPPQN * 4 / (1 << (pData[1] & 0x07));
+        if (ticksPerBeat == 0)
+          ticksPerBeat = 1;
+      }
+    }
+
+    bar += (tick - barTick) / (nom * ticksPerBeat);
+    CHECK(midiBarMapTickToPos(&barMap, tick, &pos) && pos.bar == bar &&
+        pos.beat == (tick - barTick) % (nom * ticksPerBeat) / ticksPerBeat &&
+        pos.tick == (tick - barTick) % ticksPerBeat, "bar map: tick %u differs", tick);
+  }
+}
+
+static void checkIndex(MIDI_FILE* pMF) {
+  // the single pass builder fills the same index and maps as the single builders
+  static MIDI_SEEK_POINT seekPoints[2][MAX_SEEK_POINTS];
+  static MIDI_TEMPO_POINT tempoPoints[2][MAX_MAP_POINTS];
+  static MIDI_BAR_POINT barPoints[2][MAX_MAP_POINTS];
+  MIDI_TEMPO_MAP tempoMap, builtTempoMap;
+  MIDI_BAR_MAP barMap, builtBarMap;
+  MIDI_INDEX_BUILD build;
+
+  for (uint32_t maxPoints = 1; maxPoints <= MAX_SEEK_POINTS; maxPoints *= 8) {
+    uint32_t numSeekPoints = midiFileBuildSeekIndex(pMF, seekPoints[0], maxPoints, 0);
+
+    midiTempoMapBuild(pMF, &tempoMap, tempoPoints[0], MAX_MAP_POINTS);
+    midiBarMapBuild(pMF, &barMap, barPoints[0], MAX_MAP_POINTS);
+
+    memset(&build, 0, sizeof(build));
+    build.pSeekPoints = seekPoints[1];
+    build.maxSeekPoints = maxPoints;
+    build.pTempoMap = &builtTempoMap;
+    build.pTempoPoints = tempoPoints[1];
+    build.maxTempoPoints = MAX_MAP_POINTS;
+    build.pBarMap = &builtBarMap;
+    build.pBarPoints = barPoints[1];
+    build.maxBarPoints = MAX_MAP_POINTS;
+    CHECK(midiFileBuildIndex(pMF, &build) && build.numSeekPoints == numSeekPoints &&
+        sameSeekPoints(seekPoints[0], seekPoints[1], numSeekPoints) &&
+        builtTempoMap.numPoints == tempoMap.numPoints && builtBarMap.numPoints == barMap.numPoints &&
+        memcmp(tempoPoints[0], tempoPoints[1], tempoMap.numPoints * sizeof(MIDI_TEMPO_POINT)) == 0 &&
+        sameBarPoints(barPoints[0], barPoints[1], barMap.numPoints),
+        "single pass index differs for %u points", maxPoints);
+    checkSeek(pMF, "single pass index");
+  }
+}
+
+static MIDI_EVENT streamEvents[MAX_EVENTS];
+static uint32_t numStreamEvents;
+
+static void onStreamEvent(const MIDI_EVENT* pEvent, const uint8_t* pPayload, void* pUser) {
+  if (numStreamEvents < MAX_EVENTS)
+    streamEvents[numStreamEvents++] = *pEvent;
+}
+
+static void checkStream() {
+  // The stream parser sees the tracks one after another, as stored. An event which ends a track in the readers breaks
+  // the whole stream, so then the events up to the end of that track are all there is.
+  for (int pieces = 0; pieces < 3; ++pieces) {
+    MIDI_STREAM stream;
+    uint32_t pos = 0, numRef = refFirst[numRefTracks];
+
+    numStreamEvents = 0;
+    midiStreamInit(&stream, onStreamEvent, NULL, NULL);
+    while (pos < fileSize) {
+      uint32_t num = pieces == 0 ? fileSize : pieces == 1 ? 1 : 1 + rand() % 300;
+
+      if (num > fileSize - pos)
+        num = fileSize - pos;
+      if (!midiStreamFeed(&stream, &fileData[pos], num))
+        break;
+      pos += num;
+    }
+
+    if (stream.state == streamError && (int32_t)stream.iTrack < numRefTracks)
+      numRef = refFirst[stream.iTrack + 1];
+
+    CHECK(numStreamEvents == numRef, "stream: %u of %u events", numStreamEvents, numRef);
+    for (uint32_t i = 0; i < numStreamEvents && i < numRef; ++i)
+      CHECK(sameEvent(&streamEvents[i], &refEvents[i]), "stream: event %u differs", i);
+  }
+}
+
+static void* findPoints(void* pSidecar, uint32_t size, const void* pPoints, uint32_t pointsSize) {
+  // the layout of the sidecar is the library's business, the points are found by their contents
+  for (uint32_t offset = 0; pointsSize > 0 && offset + pointsSize <= size; offset += 8)
+    if (memcmp((uint8_t*)pSidecar + offset, pPoints, pointsSize) == 0)
+      return (uint8_t*)pSidecar + offset;
+
+  return NULL;
+}
+
+static bool loadsSidecar(const void* pSidecar, uint32_t size) {
+  MIDI_FILE* pMF = openFile(modePerTrack);
+  MIDI_TEMPO_MAP tempoMap;
+  MIDI_BAR_MAP barMap;
+  bool bLoaded = pMF && midiFileLoadIndex(pMF, pSidecar, size, &tempoMap, &barMap);
+
+  midiFileClose(pMF);
+  return bLoaded;
+}
+
+#ifndef MIDI_INDEX_FAST_KEY
+static void checkEditedFile(const void* pSidecar, uint32_t size) {
+  // a payload byte changed in place keeps the chunk headers, only the key of the whole file notices it
+  static uint8_t editedData[MAX_FILE_SIZE];
+
+  for (uint32_t i = 0; i < refFirst[numRefTracks]; ++i)
+    if (refEvents[i].payloadSize > 0) {
+      MIDI_FILE* pMF;
+
+      memcpy(editedData, fileData, fileSize);
+      editedData[refEvents[i].payloadPos] ^= 0x01;
+      pMF = midiFileOpenMemory(editedData, fileSize);
+      CHECK(pMF && !midiFileLoadIndex(pMF, pSidecar, size, NULL, NULL), "sidecar of an edited file loaded");
+      midiFileClose(pMF);
+      return;
+    }
+}
+#endif
+
+static void checkSidecar() {
+  // a saved index brings back the seek index, event counts, length and maps, but only for the file it was saved for
+  static MIDI_SEEK_POINT seekPoints[MAX_SEEK_POINTS];
+  static MIDI_TEMPO_POINT tempoPoints[MAX_MAP_POINTS];
+  static MIDI_BAR_POINT barPoints[MAX_MAP_POINTS];
+  static uint64_t sidecar[(MAX_SEEK_POINTS * sizeof(MIDI_SEEK_POINT) + 2 * MAX_MAP_POINTS * sizeof(MIDI_TEMPO_POINT) +
+      4096) / 8], tampered[sizeof(sidecar) / 8];
+  MIDI_TEMPO_MAP tempoMap, loadedTempoMap;
+  MIDI_BAR_MAP barMap, loadedBarMap;
+  MIDI_TEMPO_POINT* pTempoPoint;
+  MIDI_BAR_POINT* pBarPoint;
+  MIDI_FILE* pMF = openFile(modeSingle);
+  uint32_t size;
+
+  if (!pMF)
+    return;
+
+  midiFileBuildSeekIndex(pMF, seekPoints, MAX_SEEK_POINTS, 0);
+  midiTempoMapBuild(pMF, &tempoMap, tempoPoints, MAX_MAP_POINTS);
+  midiBarMapBuild(pMF, &barMap, barPoints, MAX_MAP_POINTS);
+  for (int32_t iTrack = 0; iTrack < numRefTracks; ++iTrack)
+    CHECK(midiReadGetNumEvents(pMF, iTrack) == refFirst[iTrack + 1] - refFirst[iTrack], "track %d: %u events",
+        iTrack, midiReadGetNumEvents(pMF, iTrack));
+  CHECK(midiReadGetLastTick(pMF) == refLastTick(), "last tick %u", midiReadGetLastTick(pMF));
+
+  size = midiFileSaveIndex(pMF, &tempoMap, &barMap, sidecar, sizeof(sidecar));
+  midiFileClose(pMF);
+  if (size == 0 || size > sizeof(sidecar) || tempoMap.numPoints > MAX_MAP_POINTS || barMap.numPoints > MAX_MAP_POINTS)
+    return;
+
+  pMF = openFile(modePerTrack);
+  CHECK(midiFileLoadIndex(pMF, sidecar, size, &loadedTempoMap, &loadedBarMap), "sidecar not loaded");
+  CHECK(loadedTempoMap.numPoints == tempoMap.numPoints &&
+      memcmp(loadedTempoMap.pPoints, tempoPoints, tempoMap.numPoints * sizeof(MIDI_TEMPO_POINT)) == 0 &&
+      loadedBarMap.numPoints == barMap.numPoints && sameBarPoints(loadedBarMap.pPoints, barPoints, barMap.numPoints),
+      "sidecar maps differ");
+  for (int32_t iTrack = 0; iTrack < numRefTracks; ++iTrack)
+    CHECK(midiReadGetNumEvents(pMF, iTrack) == refFirst[iTrack + 1] - refFirst[iTrack], "sidecar track %d: %u events",
+        iTrack, midiReadGetNumEvents(pMF, iTrack));
+  CHECK(midiReadGetLastTick(pMF) == refLastTick() &&
+      midiReadGetDuration(pMF) == midiTempoMapTickToUs(&tempoMap, refLastTick()), "sidecar length differs");
+  checkSeek(pMF, "sidecar");
+  CHECK(!midiFileLoadIndex(pMF, (uint8_t*)sidecar + 8, size - 8, NULL, NULL), "broken sidecar loaded");
+  midiFileClose(pMF);
+
+  // map points which would break the conversions
+  memcpy(tampered, sidecar, size);
+  pTempoPoint = findPoints(tampered, size, tempoPoints, tempoMap.numPoints * sizeof(MIDI_TEMPO_POINT));
+  if (pTempoPoint) {
+    pTempoPoint[tempoMap.numPoints - 1].usPerQuarter = 0;
+    CHECK(!loadsSidecar(tampered, size), "sidecar with tempo 0 loaded");
+    pTempoPoint[tempoMap.numPoints - 1].usPerQuarter = tempoPoints[tempoMap.numPoints - 1].usPerQuarter;
+    pTempoPoint[0].tick = 1;
+    CHECK(!loadsSidecar(tampered, size), "sidecar with tempo map after tick 0 loaded");
+    pTempoPoint[0].tick = 0;
+    if (tempoMap.numPoints > 2) { // the first point is at 0 us, the second can't go back from it
+      pTempoPoint[2].us = pTempoPoint[1].us - 1;
+      CHECK(pTempoPoint[1].us == 0 || !loadsSidecar(tampered, size), "sidecar with tempo map going back loaded");
+      pTempoPoint[2].us = tempoPoints[2].us;
+      pTempoPoint[2].tick = pTempoPoint[1].tick;
+      CHECK(!loadsSidecar(tampered, size), "sidecar with two tempo points on a tick loaded");
+    }
+  }
+
+  memcpy(tampered, sidecar, size);
+  pBarPoint = findPoints(tampered, size, barPoints, barMap.numPoints * sizeof(MIDI_BAR_POINT));
+  if (pBarPoint) {
+    pBarPoint[barMap.numPoints - 1].nom = 0;
+    CHECK(!loadsSidecar(tampered, size), "sidecar with empty bars loaded");
+    pBarPoint[barMap.numPoints - 1].nom = barPoints[barMap.numPoints - 1].nom;
+    pBarPoint[barMap.numPoints - 1].ticksPerBeat = 0;
+    CHECK(!loadsSidecar(tampered, size), "sidecar with empty beats loaded");
+    pBarPoint[barMap.numPoints - 1].ticksPerBeat = barPoints[barMap.numPoints - 1].ticksPerBeat;
+    if (barMap.numPoints > 2) { // the first point is at bar 0, the second can't go back from it
+      pBarPoint[2].bar = pBarPoint[1].bar - 1;
+      CHECK(pBarPoint[1].bar == 0 || !loadsSidecar(tampered, size), "sidecar with bar map going back loaded");
+      pBarPoint[2].bar = barPoints[2].bar;
+      pBarPoint[2].tick = pBarPoint[1].tick;
+      CHECK(!loadsSidecar(tampered, size), "sidecar with two bar points on a tick loaded");
+    }
+  }
+
+#ifndef MIDI_INDEX_FAST_KEY
+  checkEditedFile(sidecar, size);
+#endif
+}
+
+static void checkFile() {
+  uint32_t lastTick = refLastTick();
+
+  numMerged = refMerge(mergeOrder);
+  for (int i = 0; i < NUM_SEEKS; ++i)
+    seekTicks[i] = i == 0 ? 0 : i == 1 ? lastTick : i == 2 ? lastTick + 1 : (uint32_t)rand() % (lastTick + 1);
+
+  for (tCHECK_MODE mode = 0; mode < numModes; ++mode) {
+    MIDI_FILE* pMF = openFile(mode);
+
+    CHECK(pMF != NULL, "%s: not opened", modeNames[mode]);
+    if (!pMF)
+      continue;
+
+    midiFileResetCacheStats(pMF);
+    checkTracks(pMF, modeNames[mode]);
+    checkStats(pMF, mode);
+    if (mode == modeSmallWindows)
+      checkSharedWindow(pMF);
+    checkSeek(pMF, modeNames[mode]);
+    if (mode == modeMemory || mode == modePerTrack) {
+      checkMerge(pMF);
+      checkTimeline(pMF);
+      checkSeekIndex(pMF);
+      checkTempoMap(pMF);
+      checkChase(pMF);
+      checkBarMap(pMF);
+      checkIndex(pMF);
+    }
+    midiFileClose(pMF);
+  }
+
+  checkStream();
+  checkSidecar();
+}
+
+int main(int argc, char* argv[]) {
+  char genFileName[] = "/tmp/readertestXXXXXX";
+  int numFiles = 0, fd;
+
+  srand(1);
+  for (int i = 1; i < argc; ++i) {
+    FILE* pFile = fopen(argv[i], "rb");
+
+    pFileName = argv[i];
+    if (!pFile) {
+      CHECK(false, "can't be opened");
+      continue;
+    }
+
+    fileSize = (uint32_t)fread(fileData, 1, sizeof(fileData), pFile);
+    fclose(pFile);
+    if (fileSize == sizeof(fileData) || !refParse())
+      continue; // too big or not a MIDI file, the library isn't checked against those
+
+    checkFile();
+    numFiles++;
+  }
+
+  // the cached modes read from a file, so every generated one is written to the same temporary file
+  fd = mkstemp(genFileName);
+  if (fd < 0) {
+    printf("No temporary file for the generated files\n");
+    return 2;
+  }
+
+  close(fd);
+  pFileName = genFileName;
+  for (int i = 0; i < NUM_GENERATED; ++i) {
+    FILE* pFile = fopen(genFileName, "wb");
+
+    genFile();
+    if (!pFile || fwrite(fileData, 1, fileSize, pFile) != fileSize || fclose(pFile) != 0 || !refParse()) {
+      CHECK(false, "generated file %d not written", i);
+      continue;
+    }
+
+    checkFile();
+    numFiles++;
+  }
+  unlink(genFileName);
+
+  printf("%d files, %ld checks, %ld failed\n", numFiles, numChecks, numFailed);
+  return numFailed ? 1 : 0;
+}
@@ -0,0 +1,211 @@
+/*
+ * timelinebench.c - Times midiReadTimelineParallel() against midiReadTimeline()
+ *
+ *  Usage: timelinebench [number of tracks]
+ *
+ *  Builds a format 1 file of note events with the given number of tracks (default: 16) in memory, decodes it a few
+ *  times with both functions and prints the best time of each and the speedup. make bench builds it with
+ *  MIDI_PARALLEL, otherwise the tracks are decoded one after another in both cases. Returns 0, if both timelines are
+ *  the same.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation; either version 2 of
+ *  the License,or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include "../midifile.h"
+#include "../hal/hal_posix.h"
+
+#define EVENTS_PER_TRACK	40000
+#define NUM_RUNS	5
+
+// ---- HAL functions hal_posix.h leaves to the application ----
+
+uint32_t hal_clock() {
+  return (uint32_t)clock();
+}
+
+void hal_printfError(const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+}
+
+void hal_printfWarning(char* format, ...) {
+}
+
+void hal_printfSuccess(char* format, ...) {
+}
+
+void hal_printfInfo(char* format, ...) {
+}
+
+// ---- File ----
+
+static uint8_t* pFileData;
+static uint32_t genPos;
+
+static void genByte(uint8_t value) {
+  pFileData[genPos++] = value;
+}
+
+static void genDword(uint32_t value) {
+  for (int i = 24; i >= 0; i -= 8)
+    genByte((uint8_t)(value >> i));
+}
+
+static void genTrack(int32_t iTrack) {
+  // notes with running status, a tempo change now and then
+  uint32_t start = genPos, end;
+
+  genDword(0x4D54726B); // MTrk
+  genDword(0);
+  for (int i = 0; i < EVENTS_PER_TRACK; ++i) {
+    if (i % 1000 == 0) {
+      genByte(0);
+      genByte(msgMetaEvent);
+      genByte(metaSetTempo);
+      genByte(3);
+      genByte(0x07);
+      genByte(0xA1);
+      genByte(0x20);
+      genByte(0);
+      genByte((uint8_t)(msgNoteOn | (iTrack & 0x0F)));
+    }
+    else
+      genByte((uint8_t)(rand() % 24));
+    genByte((uint8_t)(36 + rand() % 48));
+    genByte((uint8_t)(i % 2 ? 0 : 1 + rand() % 127));
+  }
+  genByte(0);
+  genByte(msgMetaEvent);
+  genByte(metaEndSequence);
+  genByte(0);
+
+  end = genPos;
+  genPos = start + 4;
+  genDword(end - start - 8);
+  genPos = end;
+}
+
+static uint32_t genFile(int32_t numTracks) {
+  genPos = 0;
+  genDword(0x4D546864); // MThd
+  genDword(6);
+  genByte(0);
+  genByte(1);
+  genByte(0);
+  genByte((uint8_t)numTracks);
+  genByte(0x01);
+  genByte(0xE0);
+  for (int32_t iTrack = 0; iTrack < numTracks; ++iTrack)
+    genTrack(iTrack);
+
+  return genPos;
+}
+
+static bool sameTimeline(const MIDI_TIMELINE* pTimeline, const MIDI_TIMELINE* pOther) {
+  uint32_t num = pTimeline->numEvents;
+
+  return num == pOther->numEvents && pTimeline->arenaSize == pOther->arenaSize &&
+      memcmp(pTimeline->pTick, pOther->pTick, num * sizeof(pTimeline->pTick[0])) == 0 &&
+      memcmp(pTimeline->pStatus, pOther->pStatus, num) == 0 && memcmp(pTimeline->pData1, pOther->pData1, num) == 0 &&
+      memcmp(pTimeline->pData2, pOther->pData2, num) == 0 && memcmp(pTimeline->pTrack, pOther->pTrack, num) == 0 &&
+      memcmp(pTimeline->pArena, pOther->pArena, pTimeline->arenaSize) == 0;
+}
+
+// ---- Timing ----
+
+static double now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char* argv[]) {
+  int32_t numTracks = argc > 1 ? atoi(argv[1]) : 16;
+  uint32_t fileSize, maxEvents, timelineSize, scratchSize;
+  MIDI_TIMELINE serial, parallel;
+  double bestSerial = 1e9, bestParallel = 1e9;
+  uint8_t *pSerialBuffer, *pParallelBuffer;
+  MIDI_EVENT* pScratch;
+  MIDI_FILE* pMF;
+  bool bSame = true;
+
+  if (numTracks < 1 || numTracks > MAX_MIDI_TRACKS) {
+    printf("1 to %d tracks\n", MAX_MIDI_TRACKS);
+    return 2;
+  }
+
+  srand(1);
+  pFileData = malloc(14 + numTracks * (8 + EVENTS_PER_TRACK * 3 + EVENTS_PER_TRACK / 1000 * 8 + 4));
+  if (!pFileData)
+    return 2;
+
+  fileSize = genFile(numTracks);
+  pMF = midiFileOpenMemory(pFileData, fileSize);
+  if (!pMF) {
+    printf("Not opened\n");
+    return 2;
+  }
+
+  timelineSize = midiTimelineGetMaxSize(pMF, &maxEvents, NULL);
+  scratchSize = maxEvents * sizeof(MIDI_EVENT);
+  pSerialBuffer = malloc(timelineSize);
+  pParallelBuffer = malloc(timelineSize);
+  pScratch = malloc(scratchSize);
+  if (!pSerialBuffer || !pParallelBuffer || !pScratch ||
+      !midiTimelineInit(&serial, pSerialBuffer, timelineSize, maxEvents) ||
+      !midiTimelineInit(&parallel, pParallelBuffer, timelineSize, maxEvents))
+    return 2;
+
+  for (int iRun = 0; iRun < NUM_RUNS; ++iRun) {
+    double start = now(), end;
+
+    if (!midiReadTimeline(pMF, &serial))
+      return 2;
+    end = now();
+    if (end - start < bestSerial)
+      bestSerial = end - start;
+
+    start = now();
+    if (!midiReadTimelineParallel(pMF, &parallel, pScratch, scratchSize))
+      return 2;
+    end = now();
+    if (end - start < bestParallel)
+      bestParallel = end - start;
+
+    bSame = bSame && sameTimeline(&serial, &parallel);
+  }
+
+  printf("%d tracks, %u events, %ld cores%s\n", numTracks, serial.numEvents, sysconf(_SC_NPROCESSORS_ONLN),
+#ifdef MIDI_PARALLEL
+      "");
+#else
+      ", built without MIDI_PARALLEL");
+#endif
+  printf("midiReadTimeline(): %.2f ms, midiReadTimelineParallel(): %.2f ms, speedup %.2f\n", bestSerial * 1e3,
+      bestParallel * 1e3, bestSerial / bestParallel);
+  if (!bSame)
+    printf("The timelines differ!\n");
+
+  midiFileClose(pMF);
+  return bSame ? 0 : 1;
+}